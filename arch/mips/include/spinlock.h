@@ -46,6 +46,13 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+spinlock_data_t spinlock_data_fetchinc(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_cas(volatile spinlock_data_t *sd, spinlock_data_t old,
+		       spinlock_data_t new);
+SPINLOCK_INLINE
+bool spinlock_data_incif(volatile spinlock_data_t *sd, spinlock_data_t val);
 
 ////////////////////////////////////////////////////////////
 
@@ -118,5 +125,84 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * Atomically increment a spinlock_data_t, returning the old value.
+ * (For ticket locks.)
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchinc(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Load the value into X and store X+1, with LL/SC as above.
+	 * Retry until the SC succeeds. The loop is in C so that no
+	 * branch (and delay slot) is needed inside the asm.
+	 */
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"addiu %1, %0, 1;"	/*   y = x + 1 */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * Compare-and-swap: atomically set a spinlock_data_t to NEW if and only
+ * if it is OLD. Returns true if it was set.
+ */
+SPINLOCK_INLINE
+bool
+spinlock_data_cas(volatile spinlock_data_t *sd, spinlock_data_t old,
+		  spinlock_data_t new)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+	spinlock_data_t m;
+
+	/*
+	 * Without branching between the LL and the SC, store back
+	 * NEW if X is OLD and X itself otherwise, which leaves the
+	 * value alone (and fails if anyone else has written it
+	 * meanwhile). M is all ones if X is OLD and 0 if not, and
+	 * the value stored is X ^ ((X ^ NEW) & M).
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"ll %0, 0(%3);"		/*   x = *sd */
+		"xor %2, %0, %4;"	/*   m = x ^ old */
+		"sltiu %2, %2, 1;"	/*   m = (x == old) */
+		"subu %2, $0, %2;"	/*   m = -m */
+		"xor %1, %0, %5;"	/*   y = x ^ new */
+		"and %1, %1, %2;"	/*   y &= m */
+		"xor %1, %1, %0;"	/*   y ^= x */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y), "=&r" (m)
+		: "r" (sd), "r" (old), "r" (new));
+	return y != 0 && x == old;
+}
+
+/*
+ * Atomically increment a spinlock_data_t if and only if it is VAL.
+ * Returns true if it was incremented.
+ */
+SPINLOCK_INLINE
+bool
+spinlock_data_incif(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	return spinlock_data_cas(sd, val, val + 1);
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -324,6 +324,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
+	dev->d_sched = NULL;
 
 	result = vfs_adddev("con", dev, 0);
 	if (result) {
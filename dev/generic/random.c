@@ -124,6 +124,7 @@ config_random(struct random_softc *rs, int unit)
 	rs->rs_dev.d_blocks = 0;
 	rs->rs_dev.d_blocksize = 1;
 	rs->rs_dev.d_data = rs;
+	rs->rs_dev.d_sched = NULL;
 
 	/* Add the VFS device structure to the VFS device list. */
 	result = vfs_adddev("random", &rs->rs_dev, 0);
@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <disksched.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +96,77 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the transfer of the current sector of the request in progress.
+ * For writes, the sector is first copied into the on-card buffer.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct diskreq *req = lh->lh_req;
+	uint32_t statval = LHD_WORKING;
+
+	if (req->dr_write) {
+		memcpy(lh->lh_buf, req->dr_buf + lh->lh_next*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, req->dr_block + lh->lh_next);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Start function for the scheduler: begin transferring a request.
+ * Called with the scheduler lock held.
+ */
+static
+void
+lhd_start(void *vlh, struct diskreq *req)
+{
+	struct lhd_softc *lh = vlh;
+
+	KASSERT(lh->lh_req == NULL);
+
+	lh->lh_req = req;
+	lh->lh_next = 0;
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed. For reads, copy the data out of
+ * the on-card buffer. If that was the last sector of the request (or
+ * it failed), hand the request back to the scheduler, which starts the
+ * next one; otherwise start the next sector right away, so the card
+ * never waits for a thread to be scheduled between sectors.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct diskreq *req = lh->lh_req;
+
+	if (req == NULL) {
+		/* Spurious completion; nothing was started. */
+		return;
+	}
+
+	if (err == 0 && !req->dr_write) {
+		membar_load_load();
+		memcpy(req->dr_buf + lh->lh_next*LHD_SECTSIZE, lh->lh_buf,
+		       LHD_SECTSIZE);
+	}
+	lh->lh_next++;
+
+	if (err != 0 || lh->lh_next == req->dr_nblocks) {
+		lh->lh_req = NULL;
+		disksched_done(&lh->lh_sched, req, err);
+	}
+	else {
+		lhd_startsector(lh);
+	}
 }
 
 /*
@@ -118,6 +180,8 @@ lhd_irq(void *vlh)
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_sched.ds_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -131,6 +195,8 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_sched.ds_lock);
 }
 
 /*
@@ -181,6 +247,8 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * The transfer itself is queued on the disk scheduler.
  */
 static
 int
@@ -192,9 +260,6 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -207,61 +272,7 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return disksched_io(&lh->lh_sched, uio);
 }
 
 static const struct device_ops lhd_devops = {
@@ -277,6 +288,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	int result;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,16 +296,13 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	/* Set up the request queue. */
+	lh->lh_req = NULL;
+	lh->lh_next = 0;
+	result = disksched_init(&lh->lh_sched, name, LHD_SECTSIZE,
+				lhd_start, lh);
+	if (result) {
+		return result;
 	}
 
 	/* Set up the VFS device structure. */
@@ -302,6 +311,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
+	lh->lh_dev.d_sched = &lh->lh_sched;
 
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
@@ -31,6 +31,7 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <disksched.h>
 
 /*
  * Our sector size
@@ -51,9 +52,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct disksched lh_sched;	/* Request queue (its lock protects
+					   the fields below and the card) */
+	struct diskreq *lh_req;		/* Request in progress */
+	uint32_t lh_next;		/* Sector of lh_req in progress */
 
 	struct device lh_dev;		/* VFS device structure */
 };
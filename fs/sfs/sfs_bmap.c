@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -49,25 +50,19 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 	daddr_t block;
 	daddr_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/*
+	 * The indirect block is used in place in the buffer cache; it
+	 * belongs to the file, like the inode.
+	 */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -89,7 +84,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 
 		/*
@@ -152,40 +147,34 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		sv->sv_i.sfi_indirect = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+		sfs_markdirty(sv);
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* (sfs_balloc has cleared it, in the buffer cache) */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* Load the indirect block */
+	result = sfs_buf_get(sfs, idblock, true, &idbuf);
+	if (result) {
+		return result;
 	}
+	ids = (uint32_t *)idbuf->b_data;
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	block = ids[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			sfs_buf_release(idbuf);
 			return result;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* Remember the block we allocated; the indirect block is dirty */
+		ids[idoff] = block;
+		sfs_buf_markdirty(idbuf);
 	}
+	sfs_buf_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -203,15 +192,6 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
@@ -220,12 +200,15 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	uint32_t i, j;
 	daddr_t block, idblock;
 	uint32_t baseblock, highblock;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	/*
+	 * The caller holds sv_lock, or (sfs_reclaim) the only reference
+	 * to the vnode.
+	 */
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -236,7 +219,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 	}
 
@@ -253,41 +236,38 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_buf_get(sfs, idblock, true, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		ids = (uint32_t *)idbuf->b_data;
 
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && ids[j] != 0) {
+				sfs_bfree(sfs, ids[j]);
+				ids[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (ids[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		if (iddirty) {
+			/* The indirect block is dirty */
+			sfs_buf_markdirty(idbuf);
+		}
+		sfs_buf_release(idbuf);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+			sfs_markdirty(sv);
 		}
 	}
 
@@ -295,9 +275,8 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_markdirty(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
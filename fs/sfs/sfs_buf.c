@@ -0,0 +1,868 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * All block I/O of SFS goes through a cache of SFS_BLOCKSIZE buffers
+ * shared by all mounted volumes and keyed by (device, block). Buffers
+ * live in whole pages (frames), which are allocated as the cache grows
+ * up to SFS_BUF_MAXFRAMES and handed back to the VM when it runs out of
+ * memory. Unreferenced buffers are kept on an LRU list; the least
+ * recently used one is recycled when a new block is needed, after
+ * being written back if it is dirty. Otherwise dirty buffers are
+ * written by the write-back thread once they are old enough (or the
+ * cache is getting full of them), and all at once on sfs_sync. Blocks
+ * can also be read in ahead of time (sfs_buf_readahead). Read-ahead and
+ * write-back I/O is queued on the device's disk scheduler without
+ * waiting and completes from its interrupt handler.
+ *
+ * The cache protects its own state (hash chains, LRU list, flags) with
+ * a spinlock, so that the VM can reclaim frames from any context. The
+ * contents of a block are not locked here: each block belongs to one
+ * file system lock (the sv_lock of the file or directory it is part
+ * of, or the volume's freemap lock), which callers hold while they use
+ * it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <thread.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <device.h>
+#include <disksched.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * A frame: one page holding SFS_BUFS_PER_FRAME buffers.
+ */
+struct sfs_bufframe {
+	char *bf_page;			/* NULL if not allocated */
+	struct sfs_buf bf_bufs[SFS_BUFS_PER_FRAME];
+};
+
+static struct sfs_bufframe sfs_frames[SFS_BUF_MAXFRAMES];
+static unsigned sfs_nframes;		/* frames allocated */
+static bool sfs_growing;		/* a frame is being allocated */
+
+static struct sfs_buf *sfs_hash[SFS_BUF_HASHSIZE];
+static struct sfs_buf *sfs_lruhead;	/* least recently used */
+static struct sfs_buf *sfs_lrutail;	/* most recently used */
+
+static struct spinlock sfs_buflock;
+static struct wchan *sfs_bufwchan;	/* waiting for a buffer or its I/O */
+static bool sfs_buf_ready;
+static unsigned sfs_buf_ndirty;		/* dirty buffers */
+static unsigned sfs_wb_interval = SFS_WB_INTERVAL;
+
+/* Statistics */
+static uint32_t sfs_buf_lookups;	/* sfs_buf_get calls */
+static uint32_t sfs_buf_hits;		/* ...that found the block cached */
+static uint32_t sfs_buf_reads;		/* blocks read from disk */
+static uint32_t sfs_buf_writes;		/* blocks written to disk */
+static uint32_t sfs_buf_reclaimed;	/* frames given back to the VM */
+static uint32_t sfs_buf_raissued;	/* blocks read ahead */
+static uint32_t sfs_buf_rahits;		/* ...that were then used */
+static uint32_t sfs_buf_wbblocks;	/* blocks written by the thread */
+static uint32_t sfs_buf_wbchained;	/* ...sent in one transfer with the next */
+static uint32_t sfs_buf_wbfull;		/* flushes due to the dirty ratio */
+static uint32_t sfs_buf_evictwrites;	/* blocks written to recycle them */
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list (called with sfs_buflock held)
+
+static
+unsigned
+sfs_buf_hash(struct sfs_fs *sfs, daddr_t block)
+{
+	return (((uintptr_t)sfs->sfs_device >> 4) ^ block)
+		& (SFS_BUF_HASHSIZE - 1);
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sfs_hash[sfs_buf_hash(sfs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_block == block &&
+		    b->b_fs->sfs_device == sfs->sfs_device) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_hashinsert(struct sfs_buf *b)
+{
+	unsigned h = sfs_buf_hash(b->b_fs, b->b_block);
+
+	b->b_hashnext = sfs_hash[h];
+	sfs_hash[h] = b;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_hash[sfs_buf_hash(b->b_fs, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(sfs_lruhead == b);
+		sfs_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(sfs_lrutail == b);
+		sfs_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Most recently used end: for buffers holding a block. */
+static
+void
+sfs_buf_lruappend(struct sfs_buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+/* Least recently used end: for buffers holding nothing useful. */
+static
+void
+sfs_buf_lruprepend(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = b;
+	}
+	else {
+		sfs_lrutail = b;
+	}
+	sfs_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffer allocation
+
+/*
+ * Transfer a buffer to or from disk. Called without sfs_buflock, with
+ * the buffer marked busy.
+ */
+static
+int
+sfs_buf_io(struct sfs_buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(b->b_busy);
+
+	SFSUIO(&iov, &ku, b->b_data, b->b_block, rw);
+	result = sfs_rwblock(b->b_fs, &ku);
+
+	spinlock_acquire(&sfs_buflock);
+	if (rw == UIO_READ) {
+		sfs_buf_reads++;
+	}
+	else {
+		sfs_buf_writes++;
+	}
+	spinlock_release(&sfs_buflock);
+
+	return result;
+}
+
+/*
+ * Add a frame to the cache. Drops sfs_buflock while allocating.
+ */
+static
+void
+sfs_buf_grow(void)
+{
+	char *page;
+	unsigned f, i;
+
+	sfs_growing = true;
+	spinlock_release(&sfs_buflock);
+	page = (char *)alloc_kpages(1);
+	spinlock_acquire(&sfs_buflock);
+	sfs_growing = false;
+
+	if (page == NULL) {
+		return;
+	}
+
+	for (f = 0; sfs_frames[f].bf_page != NULL; f++) {
+		KASSERT(f < SFS_BUF_MAXFRAMES - 1);
+	}
+	sfs_frames[f].bf_page = page;
+	for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+		struct sfs_buf *b = &sfs_frames[f].bf_bufs[i];
+
+		b->b_fs = NULL;
+		b->b_data = page + i * SFS_BLOCKSIZE;
+		b->b_refcount = 0;
+		b->b_valid = b->b_dirty = b->b_busy = false;
+		b->b_readahead = false;
+		b->b_hashnext = NULL;
+		sfs_buf_lruprepend(b);
+	}
+	sfs_nframes++;
+}
+
+/*
+ * Get a buffer to hold a new block: a free one, a new frame while the
+ * cache is below its maximum size, or else the least recently used
+ * one. Called with sfs_buflock held. Returns NULL if the lock had to
+ * be dropped (to allocate a frame, write back a dirty buffer or wait
+ * for a buffer to be released), in which case the caller must look the
+ * block up again.
+ */
+static
+struct sfs_buf *
+sfs_buf_alloc(void)
+{
+	struct sfs_buf *b = sfs_lruhead;
+	int result;
+
+	if ((b == NULL || b->b_valid) &&
+	    sfs_nframes < SFS_BUF_MAXFRAMES && !sfs_growing) {
+		sfs_buf_grow();
+		return NULL;
+	}
+
+	if (b == NULL) {
+		/* Every buffer is in use. */
+		wchan_sleep(sfs_bufwchan, &sfs_buflock);
+		return NULL;
+	}
+
+	if (b->b_dirty) {
+		sfs_buf_lruremove(b);
+		b->b_busy = true;
+		spinlock_release(&sfs_buflock);
+		result = sfs_buf_io(b, UIO_WRITE);
+		spinlock_acquire(&sfs_buflock);
+		b->b_busy = false;
+		sfs_buf_evictwrites++;
+		if (result == 0) {
+			b->b_dirty = false;
+			sfs_buf_ndirty--;
+		}
+		if (b->b_refcount == 0) {
+			/* If it could not be written, don't retry it at once */
+			if (b->b_dirty) {
+				sfs_buf_lruappend(b);
+			}
+			else {
+				sfs_buf_lruprepend(b);
+			}
+		}
+		wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+		return NULL;
+	}
+
+	sfs_buf_lruremove(b);
+	if (b->b_fs != NULL) {
+		sfs_buf_hashremove(b);
+		b->b_fs = NULL;
+	}
+	b->b_valid = false;
+	b->b_readahead = false;
+	return b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Get the buffer of a block. If DOREAD is set, the block is read from
+ * disk unless it is cached; otherwise the caller is going to overwrite
+ * the whole block and must call sfs_buf_markdirty when done. The buffer
+ * must be released with sfs_buf_release.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool doread,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	spinlock_acquire(&sfs_buflock);
+	sfs_buf_lookups++;
+
+ again:
+	b = sfs_buf_lookup(sfs, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			wchan_sleep(sfs_bufwchan, &sfs_buflock);
+			goto again;
+		}
+		if (b->b_refcount == 0) {
+			sfs_buf_lruremove(b);
+		}
+		b->b_refcount++;
+		if (b->b_valid) {
+			sfs_buf_hits++;
+		}
+		if (b->b_readahead) {
+			sfs_buf_rahits++;
+			b->b_readahead = false;
+		}
+		if (b->b_valid || !doread) {
+			spinlock_release(&sfs_buflock);
+			*ret = b;
+			return 0;
+		}
+	}
+	else {
+		b = sfs_buf_alloc();
+		if (b == NULL) {
+			goto again;
+		}
+		b->b_fs = sfs;
+		b->b_block = block;
+		b->b_refcount = 1;
+		b->b_valid = b->b_dirty = false;
+		sfs_buf_hashinsert(b);
+		if (!doread) {
+			spinlock_release(&sfs_buflock);
+			*ret = b;
+			return 0;
+		}
+	}
+
+	/* Read the block in. */
+	b->b_busy = true;
+	spinlock_release(&sfs_buflock);
+	result = sfs_buf_io(b, UIO_READ);
+	spinlock_acquire(&sfs_buflock);
+	b->b_busy = false;
+	b->b_valid = (result == 0);
+	wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+	spinlock_release(&sfs_buflock);
+
+	if (result) {
+		sfs_buf_release(b);
+		return result;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Completion of a read-ahead. Called by the disk scheduler with its
+ * lock held, possibly in an interrupt handler.
+ */
+static
+void
+sfs_buf_readdone(struct diskreq *req, void *arg)
+{
+	struct sfs_buf *b = arg;
+
+	KASSERT(req == &b->b_req);
+
+	spinlock_acquire(&sfs_buflock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	b->b_valid = (req->dr_result == 0);
+	sfs_buf_reads++;
+	if (b->b_refcount == 0) {
+		if (b->b_valid) {
+			sfs_buf_lruappend(b);
+		}
+		else {
+			sfs_buf_lruprepend(b);
+		}
+	}
+	wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+	spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Start reading a block into the cache without waiting for it. Does
+ * nothing if the block is already cached, if every buffer is in use or
+ * if the device has no disk scheduler. Errors are not reported: the
+ * buffer is left invalid and sfs_buf_get reads the block again.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, daddr_t block)
+{
+	struct disksched *ds = sfs->sfs_device->d_sched;
+	struct sfs_buf *b;
+
+	if (ds == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&sfs_buflock);
+ again:
+	if (sfs_buf_lookup(sfs, block) != NULL) {
+		spinlock_release(&sfs_buflock);
+		return;
+	}
+	if (sfs_lruhead == NULL &&
+	    (sfs_nframes == SFS_BUF_MAXFRAMES || sfs_growing)) {
+		/* Don't wait for a buffer just to read ahead. */
+		spinlock_release(&sfs_buflock);
+		return;
+	}
+	b = sfs_buf_alloc();
+	if (b == NULL) {
+		goto again;
+	}
+	b->b_fs = sfs;
+	b->b_block = block;
+	b->b_refcount = 0;
+	b->b_valid = b->b_dirty = false;
+	b->b_busy = true;
+	b->b_readahead = true;
+	sfs_buf_hashinsert(b);
+	sfs_buf_raissued++;
+	spinlock_release(&sfs_buflock);
+
+	b->b_req.dr_buf = b->b_data;
+	b->b_req.dr_block = block;
+	b->b_req.dr_nblocks = 1;
+	b->b_req.dr_write = false;
+	b->b_req.dr_callback = sfs_buf_readdone;
+	b->b_req.dr_cbarg = b;
+	disksched_start(ds, &b->b_req);
+}
+
+/*
+ * Record that the contents of a buffer have been modified.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	struct timespec now;
+
+	gettime(&now);
+
+	spinlock_acquire(&sfs_buflock);
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		b->b_dirtysince = now.tv_sec;
+		sfs_buf_ndirty++;
+	}
+	spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Release a buffer obtained with sfs_buf_get.
+ */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	spinlock_acquire(&sfs_buflock);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		if (b->b_valid) {
+			sfs_buf_lruappend(b);
+		}
+		else {
+			sfs_buf_lruprepend(b);
+		}
+		wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+	}
+	spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Write back all the dirty buffers of a volume.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned f, i;
+	int result;
+
+	spinlock_acquire(&sfs_buflock);
+ again:
+	for (f = 0; f < SFS_BUF_MAXFRAMES; f++) {
+		if (sfs_frames[f].bf_page == NULL) {
+			continue;
+		}
+		for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+			b = &sfs_frames[f].bf_bufs[i];
+			if (b->b_fs == NULL ||
+			    b->b_fs->sfs_device != sfs->sfs_device ||
+			    !b->b_dirty) {
+				continue;
+			}
+			if (b->b_busy) {
+				/* Being written back already; wait for it. */
+				wchan_sleep(sfs_bufwchan, &sfs_buflock);
+				goto again;
+			}
+
+			if (b->b_refcount == 0) {
+				sfs_buf_lruremove(b);
+			}
+			b->b_busy = true;
+			spinlock_release(&sfs_buflock);
+			result = sfs_buf_io(b, UIO_WRITE);
+			spinlock_acquire(&sfs_buflock);
+			b->b_busy = false;
+			if (result == 0) {
+				b->b_dirty = false;
+				sfs_buf_ndirty--;
+			}
+			if (b->b_refcount == 0) {
+				sfs_buf_lruappend(b);
+			}
+			wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+			if (result) {
+				spinlock_release(&sfs_buflock);
+				return result;
+			}
+			/* The lock was dropped; start over. */
+			goto again;
+		}
+	}
+	spinlock_release(&sfs_buflock);
+	return 0;
+}
+
+/*
+ * Drop all the buffers of a volume being unmounted. It must have been
+ * synced already; reads ahead still in progress are waited for.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned f, i;
+
+	spinlock_acquire(&sfs_buflock);
+ again:
+	for (f = 0; f < SFS_BUF_MAXFRAMES; f++) {
+		if (sfs_frames[f].bf_page == NULL) {
+			continue;
+		}
+		for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+			b = &sfs_frames[f].bf_bufs[i];
+			if (b->b_fs == NULL ||
+			    b->b_fs->sfs_device != sfs->sfs_device) {
+				continue;
+			}
+			if (b->b_busy) {
+				wchan_sleep(sfs_bufwchan, &sfs_buflock);
+				goto again;
+			}
+			KASSERT(b->b_refcount == 0);
+			KASSERT(!b->b_dirty);
+			sfs_buf_hashremove(b);
+			sfs_buf_lruremove(b);
+			b->b_fs = NULL;
+			b->b_valid = false;
+			sfs_buf_lruprepend(b);
+		}
+	}
+	spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Reclaim function for the VM: give back frames whose buffers are all
+ * clean and unused. Never sleeps.
+ */
+static
+int
+sfs_buf_reclaim(unsigned npages)
+{
+	struct sfs_buf *b;
+	char *page;
+	unsigned f, i;
+	unsigned freed = 0;
+
+	spinlock_acquire(&sfs_buflock);
+	for (f = 0; f < SFS_BUF_MAXFRAMES && freed < npages; f++) {
+		if (sfs_frames[f].bf_page == NULL) {
+			continue;
+		}
+		for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+			b = &sfs_frames[f].bf_bufs[i];
+			if (b->b_refcount > 0 || b->b_busy || b->b_dirty) {
+				break;
+			}
+		}
+		if (i < SFS_BUFS_PER_FRAME) {
+			continue;
+		}
+
+		for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+			b = &sfs_frames[f].bf_bufs[i];
+			if (b->b_fs != NULL) {
+				sfs_buf_hashremove(b);
+				b->b_fs = NULL;
+			}
+			sfs_buf_lruremove(b);
+		}
+		page = sfs_frames[f].bf_page;
+		sfs_frames[f].bf_page = NULL;
+		sfs_nframes--;
+		sfs_buf_reclaimed++;
+
+		spinlock_release(&sfs_buflock);
+		free_kpages((vaddr_t)page);
+		spinlock_acquire(&sfs_buflock);
+		freed++;
+	}
+	spinlock_release(&sfs_buflock);
+
+	return freed;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Write-back
+
+/*
+ * Completion of a write-back. Called by the disk scheduler with its
+ * lock held, possibly in an interrupt handler. If the write failed, the
+ * buffer stays dirty and is tried again on the next flush.
+ */
+static
+void
+sfs_buf_writedone(struct diskreq *req, void *arg)
+{
+	struct sfs_buf *b = arg;
+
+	KASSERT(req == &b->b_req);
+
+	spinlock_acquire(&sfs_buflock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_refcount == 0);
+	b->b_busy = false;
+	sfs_buf_writes++;
+	if (req->dr_chain != NULL) {
+		/* The scheduler sent the next block in the same transfer. */
+		sfs_buf_wbchained++;
+	}
+	if (req->dr_result == 0) {
+		b->b_dirty = false;
+		sfs_buf_ndirty--;
+	}
+	sfs_buf_lruappend(b);
+	wchan_wakeall(sfs_bufwchan, &sfs_buflock);
+	spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Queue the writes of the unused dirty buffers that are old enough, or
+ * of all of them if too much of the cache is dirty. Buffers being
+ * referenced are skipped, since their owner may be changing them.
+ *
+ * Each block is its own request; since they are all queued at once,
+ * the disk scheduler chains the runs of adjacent blocks into single
+ * transfers (sfs_buf_writedone counts them).
+ */
+static
+void
+sfs_buf_flush(void)
+{
+	struct sfs_buf *b, *list = NULL;
+	struct disksched *ds;
+	struct timespec now;
+	unsigned f, i;
+	bool all;
+
+	gettime(&now);
+
+	spinlock_acquire(&sfs_buflock);
+	all = sfs_buf_ndirty * 100 >
+		sfs_nframes * SFS_BUFS_PER_FRAME * SFS_WB_DIRTYPCT;
+	if (all) {
+		sfs_buf_wbfull++;
+	}
+	for (f = 0; f < SFS_BUF_MAXFRAMES; f++) {
+		if (sfs_frames[f].bf_page == NULL) {
+			continue;
+		}
+		for (i = 0; i < SFS_BUFS_PER_FRAME; i++) {
+			b = &sfs_frames[f].bf_bufs[i];
+			if (!b->b_dirty || b->b_busy || b->b_refcount > 0) {
+				continue;
+			}
+			if (!all && now.tv_sec - b->b_dirtysince < SFS_WB_MAXAGE) {
+				continue;
+			}
+			if (b->b_fs->sfs_device->d_sched == NULL) {
+				/* Left for sfs_sync. */
+				continue;
+			}
+
+			/* Unreferenced, so on the LRU list; use its link. */
+			sfs_buf_lruremove(b);
+			b->b_busy = true;
+			b->b_lrunext = list;
+			list = b;
+			sfs_buf_wbblocks++;
+		}
+	}
+	spinlock_release(&sfs_buflock);
+
+	while (list != NULL) {
+		b = list;
+		list = b->b_lrunext;
+		b->b_lrunext = NULL;
+
+		ds = b->b_fs->sfs_device->d_sched;
+		b->b_req.dr_buf = b->b_data;
+		b->b_req.dr_block = b->b_block;
+		b->b_req.dr_nblocks = 1;
+		b->b_req.dr_write = true;
+		b->b_req.dr_callback = sfs_buf_writedone;
+		b->b_req.dr_cbarg = b;
+		disksched_start(ds, &b->b_req);
+	}
+}
+
+/*
+ * The write-back thread.
+ */
+static
+void
+sfs_buf_wbthread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(sfs_wb_interval);
+		sfs_writeback_meta();
+		sfs_buf_flush();
+	}
+}
+
+/*
+ * Change how often the write-back thread runs.
+ */
+void
+sfs_buf_setinterval(unsigned seconds)
+{
+	KASSERT(seconds > 0);
+	sfs_wb_interval = seconds;
+}
+
+/*
+ * Set up the buffer cache. Called on each mount; only the first call
+ * does anything.
+ */
+void
+sfs_buf_bootstrap(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_buf_ready) {
+		return;
+	}
+
+	spinlock_init(&sfs_buflock);
+	sfs_bufwchan = wchan_create("sfs_buf");
+	if (sfs_bufwchan == NULL) {
+		panic("sfs: Could not create the buffer cache wait channel\n");
+	}
+	vm_register_reclaim(sfs_buf_reclaim);
+	sfs_buf_ready = true;
+
+	if (thread_fork("sfs_writeback", NULL, sfs_buf_wbthread, NULL, 0)) {
+		panic("sfs: Could not start the write-back thread\n");
+	}
+}
+
+/*
+ * Print the buffer cache statistics.
+ */
+void
+sfs_buf_printstats(void)
+{
+	uint32_t lookups, hits, reads, writes, reclaimed, raissued, rahits;
+	uint32_t wbblocks, wbchained, wbfull, evictwrites;
+	unsigned nframes, ndirty;
+
+	if (!sfs_buf_ready) {
+		kprintf("sfs: buffer cache not in use\n");
+		return;
+	}
+
+	spinlock_acquire(&sfs_buflock);
+	lookups = sfs_buf_lookups;
+	hits = sfs_buf_hits;
+	reads = sfs_buf_reads;
+	writes = sfs_buf_writes;
+	reclaimed = sfs_buf_reclaimed;
+	raissued = sfs_buf_raissued;
+	rahits = sfs_buf_rahits;
+	wbblocks = sfs_buf_wbblocks;
+	wbchained = sfs_buf_wbchained;
+	wbfull = sfs_buf_wbfull;
+	evictwrites = sfs_buf_evictwrites;
+	nframes = sfs_nframes;
+	ndirty = sfs_buf_ndirty;
+	spinlock_release(&sfs_buflock);
+
+	kprintf("sfs buffer cache: %u/%u frames (%u buffers)\n",
+		nframes, SFS_BUF_MAXFRAMES, nframes * SFS_BUFS_PER_FRAME);
+	kprintf("sfs buffer cache: %u lookups, %u hits (%u%%)\n",
+		lookups, hits,
+		lookups ? (unsigned)(hits * 100ULL / lookups) : 0);
+	kprintf("sfs buffer cache: %u blocks read, %u blocks written, "
+		"%u frames reclaimed by the VM\n",
+		reads, writes, reclaimed);
+	kprintf("sfs buffer cache: %u blocks read ahead, %u used (%u%%)\n",
+		raissued, rahits,
+		raissued ? (unsigned)(rahits * 100ULL / raissued) : 0);
+	kprintf("sfs write-back: every %u s, %u dirty buffers, "
+		"%u full-cache flushes\n",
+		sfs_wb_interval, ndirty, wbfull);
+	kprintf("sfs write-back: %u blocks written in the background "
+		"(%u chained to the next one), %u to recycle a buffer\n",
+		wbblocks, wbchained, evictwrites);
+}
@@ -39,6 +39,34 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory name index of a directory.
+ *
+ * Built on the first lookup in the directory by reading all its slots,
+ * and then kept up to date by sfs_dir_link and sfs_dir_unlink, so that
+ * lookups are a hash probe instead of a scan of the directory. It also
+ * remembers the free slots, so that links don't have to look for one.
+ * If memory runs out while the index is being updated, it is dropped
+ * and rebuilt on the next lookup; if it cannot be built, lookups fall
+ * back to scanning the directory.
+ */
+
+#define SFS_DIRINDEX_MINBUCKETS	16	/* initial size (a power of 2) */
+
+struct sfs_dirname {
+	char *dn_name;			/* NULL for a free slot */
+	uint32_t dn_ino;
+	int dn_slot;
+	struct sfs_dirname *dn_next;	/* next in bucket or free list */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname **di_buckets;
+	unsigned di_nbuckets;		/* power of 2 */
+	unsigned di_nnames;		/* names in the buckets */
+	struct sfs_dirname *di_free;	/* free slots */
+};
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -95,6 +123,242 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Name index
+
+static
+unsigned
+sfs_dir_hash(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+struct sfs_dirname **
+sfs_dir_bucket(struct sfs_dirindex *di, const char *name)
+{
+	return &di->di_buckets[sfs_dir_hash(name) & (di->di_nbuckets - 1)];
+}
+
+/*
+ * Double the number of buckets. If there is no memory for that, the
+ * chains just get longer.
+ */
+static
+void
+sfs_dir_growindex(struct sfs_dirindex *di)
+{
+	struct sfs_dirname **old, *dn, *next, **bucket;
+	unsigned oldn, i;
+
+	old = di->di_buckets;
+	oldn = di->di_nbuckets;
+
+	di->di_buckets = kmalloc(2 * oldn * sizeof(*di->di_buckets));
+	if (di->di_buckets == NULL) {
+		di->di_buckets = old;
+		return;
+	}
+	di->di_nbuckets = 2 * oldn;
+	for (i=0; i<di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+
+	for (i=0; i<oldn; i++) {
+		for (dn = old[i]; dn != NULL; dn = next) {
+			next = dn->dn_next;
+			bucket = sfs_dir_bucket(di, dn->dn_name);
+			dn->dn_next = *bucket;
+			*bucket = dn;
+		}
+	}
+	kfree(old);
+}
+
+/*
+ * Add a name (or, if NAME is NULL, a free slot) to an index.
+ */
+static
+int
+sfs_dir_indexadd(struct sfs_dirindex *di, const char *name, uint32_t ino,
+		 int slot)
+{
+	struct sfs_dirname *dn, **bucket;
+
+	dn = kmalloc(sizeof(*dn));
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_ino = ino;
+	dn->dn_slot = slot;
+
+	if (name == NULL) {
+		dn->dn_name = NULL;
+		dn->dn_next = di->di_free;
+		di->di_free = dn;
+		return 0;
+	}
+
+	dn->dn_name = kstrdup(name);
+	if (dn->dn_name == NULL) {
+		kfree(dn);
+		return ENOMEM;
+	}
+	bucket = sfs_dir_bucket(di, name);
+	dn->dn_next = *bucket;
+	*bucket = dn;
+	di->di_nnames++;
+
+	if (di->di_nnames > 2 * di->di_nbuckets) {
+		sfs_dir_growindex(di);
+	}
+	return 0;
+}
+
+static
+struct sfs_dirname *
+sfs_dir_indexfind(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirname *dn;
+
+	for (dn = *sfs_dir_bucket(di, name); dn != NULL; dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			return dn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove a name from an index (or, if NAME is NULL, the free slot
+ * SLOT). Does nothing if it isn't there.
+ */
+static
+void
+sfs_dir_indexremove(struct sfs_dirindex *di, const char *name, int slot)
+{
+	struct sfs_dirname **pp, *dn;
+
+	pp = (name == NULL) ? &di->di_free : sfs_dir_bucket(di, name);
+	for (; *pp != NULL; pp = &(*pp)->dn_next) {
+		dn = *pp;
+		if (name == NULL ? dn->dn_slot == slot :
+		    !strcmp(dn->dn_name, name)) {
+			*pp = dn->dn_next;
+			if (name != NULL) {
+				kfree(dn->dn_name);
+				di->di_nnames--;
+			}
+			kfree(dn);
+			return;
+		}
+	}
+}
+
+/*
+ * Free the name index of a directory, if it has one.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirname *dn;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	sv->sv_dirindex = NULL;
+
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((dn = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = dn->dn_next;
+			kfree(dn->dn_name);
+			kfree(dn);
+		}
+	}
+	while ((dn = di->di_free) != NULL) {
+		di->di_free = dn->dn_next;
+		kfree(dn);
+	}
+	kfree(di->di_buckets);
+	kfree(di);
+}
+
+/*
+ * Get the name index of a directory, building it if needed. Hands back
+ * NULL (and no error) if there is not enough memory for it.
+ */
+static
+int
+sfs_dir_getindex(struct sfs_vnode *sv, struct sfs_dirindex **ret)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+
+	if (sv->sv_dirindex != NULL) {
+		*ret = sv->sv_dirindex;
+		return 0;
+	}
+	*ret = NULL;
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return 0;
+	}
+	di->di_nbuckets = SFS_DIRINDEX_MINBUCKETS;
+	di->di_buckets = kmalloc(di->di_nbuckets * sizeof(*di->di_buckets));
+	if (di->di_buckets == NULL) {
+		kfree(di);
+		return 0;
+	}
+	for (i=0; i<(int)di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+	di->di_nnames = 0;
+	di->di_free = NULL;
+	sv->sv_dirindex = di;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			result = sfs_dir_indexadd(di, NULL, 0, i);
+		}
+		else {
+			/* Ensure null termination, just in case */
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+			/* Each name may legally appear only once... */
+			KASSERT(sfs_dir_indexfind(di, tsd.sfd_name) == NULL);
+
+			result = sfs_dir_indexadd(di, tsd.sfd_name,
+						  tsd.sfd_ino, i);
+		}
+		if (result) {
+			/* Out of memory; scan the directory instead. */
+			sfs_dir_dropindex(sv);
+			return 0;
+		}
+	}
+
+	*ret = di;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -104,9 +368,33 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirname *dn;
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	/* Use the name index if there is (or can be) one. */
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
+		return result;
+	}
+	if (di != NULL) {
+		if (emptyslot != NULL && di->di_free != NULL) {
+			*emptyslot = di->di_free->dn_slot;
+		}
+		dn = sfs_dir_indexfind(di, name);
+		if (dn == NULL) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = dn->dn_slot;
+		}
+		if (ino != NULL) {
+			*ino = dn->dn_ino;
+		}
+		return 0;
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -186,7 +474,19 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the name index. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dir_indexremove(sv->sv_dirindex, NULL, emptyslot);
+		if (sfs_dir_indexadd(sv->sv_dirindex, name, ino, emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -195,14 +495,42 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_direntry sd, old;
+	int result;
+
+	/*
+	 * If there is a name index, get the name being removed from it.
+	 * (The block is in the buffer cache, since the caller has just
+	 * looked the name up.)
+	 */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_readdir(sv, slot, &old);
+		if (result) {
+			/* OLD is garbage; the index can't be kept right. */
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		old.sfd_name[sizeof(old.sfd_name)-1] = 0;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the name index. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dir_indexremove(sv->sv_dirindex, old.sfd_name, 0);
+		if (sfs_dir_indexadd(sv->sv_dirindex, NULL, 0, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -38,12 +38,16 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Mounted volumes, for the write-back thread (protected by the biglock) */
+static struct sfs_fs *sfs_mounted;
+
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
@@ -105,26 +109,81 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Pick the dirty vnode to sync after CUR (NULL: the first one) and mark
+ * it with the number of this pass. Normally that is just the next one
+ * on the dirty list; if CUR has left the list meanwhile (someone else
+ * synced it), go back to the head and skip the vnodes already marked.
+ * Called with sfs_vnlock held.
+ */
+static
+struct sfs_vnode *
+sfs_sync_nextdirty(struct sfs_fs *sfs, struct sfs_vnode *cur, unsigned gen)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (cur != NULL && cur->sv_dirty) {
+		sv = cur->sv_dirtynext;
+	}
+	else {
+		sv = sfs->sfs_dirtyvnodes;
+	}
+	while (sv != NULL && sv->sv_syncgen == gen) {
+		sv = sv->sv_dirtynext;
+	}
+	if (sv != NULL) {
+		sv->sv_syncgen = gen;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+	return sv;
+}
+
 /*
  * Sync routine for the vnode table.
+ *
+ * VOP_FSYNC takes the vnode's sv_lock, which comes before the vnode
+ * table lock, so each dirty vnode is synced after dropping the table
+ * lock. The list is walked once, with a cursor: before syncing a vnode
+ * the next one is picked and referenced, under the table lock (which
+ * keeps sfs_reclaim away), so that it is still there to continue from.
+ * Vnodes are marked with the number of this pass when picked, so none
+ * is synced twice (e.g. if it fails to sync and stays on the list).
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode *sv, *next;
+	unsigned gen;
+
+	lock_acquire(sfs->sfs_vnlock);
+	gen = ++sfs->sfs_syncgen;
+	sv = sfs_sync_nextdirty(sfs, NULL, gen);
+	if (sv != NULL) {
+		VOP_INCREF(&sv->sv_absvn);
+	}
+	while (sv != NULL) {
+		next = sfs_sync_nextdirty(sfs, sv, gen);
+		if (next != NULL) {
+			VOP_INCREF(&next->sv_absvn);
+		}
+		lock_release(sfs->sfs_vnlock);
+
+		VOP_FSYNC(&sv->sv_absvn);
+		VOP_DECREF(&sv->sv_absvn);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		lock_acquire(sfs->sfs_vnlock);
+		sv = next;
 	}
+	lock_release(sfs->sfs_vnlock);
 	return 0;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Called with sfs_freemaplock held.
  */
 static
 int
@@ -132,6 +191,8 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
@@ -144,7 +205,7 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 }
 
 /*
- * Sync routine for the superblock.
+ * Sync routine for the superblock. Called with sfs_freemaplock held.
  */
 static
 int
@@ -152,6 +213,8 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
@@ -174,8 +237,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,26 +272,53 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	lock_acquire(sfs->sfs_freemaplock);
+
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Now push everything above out of the buffer cache. */
+	return sfs_buf_sync(sfs);
+}
+
+/*
+ * Write the metadata kept in memory (inodes, freemap and superblock) of
+ * all mounted volumes into the buffer cache, without waiting for the
+ * disk; the write-back thread calls this so that metadata ages in the
+ * cache like data instead of waiting for an explicit sync.
+ */
+void
+sfs_writeback_meta(void)
+{
+	struct sfs_fs *sfs;
+
+	/* (The biglock only keeps the volumes from being unmounted.) */
+	vfs_biglock_acquire();
+	for (sfs = sfs_mounted; sfs != NULL; sfs = sfs->sfs_next) {
+		/* Errors will show up again on the next sync. */
+		(void)sfs_sync_vnodes(sfs);
+		lock_acquire(sfs->sfs_freemaplock);
+		(void)sfs_sync_freemap(sfs);
+		(void)sfs_sync_superblock(sfs);
+		lock_release(sfs->sfs_freemaplock);
+	}
 	vfs_biglock_release();
-	return 0;
 }
 
 /*
@@ -243,13 +331,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes while mounted. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,8 +346,11 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
 	KASSERT(sfs->sfs_device == NULL);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	kfree(sfs);
 }
 
@@ -277,19 +364,32 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	struct sfs_fs **pp;
 
 	vfs_biglock_acquire();
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Drop our (clean) cached blocks. */
+	sfs_buf_invalidate(sfs);
+
+	/* Take it off the list of mounted volumes. */
+	for (pp = &sfs_mounted; *pp != sfs; pp = &(*pp)->sfs_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sfs->sfs_next;
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -321,6 +421,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -351,17 +452,33 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	for (i=0; i<SFS_VHASHSIZE; i++) {
+		sfs->sfs_vnodes[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	spinlock_init(&sfs->sfs_dirtylock);
+	sfs->sfs_dirtyvnodes = NULL;
+	sfs->sfs_syncgen = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	sfs->sfs_next = NULL;
+
 	return sfs;
 
+cleanup_vnlock:
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -390,6 +507,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	vfs_biglock_acquire();
 
+	/* Set up the buffer and vnode caches if this is the first mount. */
+	sfs_buf_bootstrap();
+	sfs_inode_bootstrap();
+
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -421,6 +542,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -434,6 +556,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -451,6 +574,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -458,12 +582,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		sfs_buf_invalidate(sfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
+	/* Add it to the volumes the write-back thread looks at */
+	sfs->sfs_next = sfs_mounted;
+	sfs_mounted = sfs;
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
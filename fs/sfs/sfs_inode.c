@@ -35,13 +35,63 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <slab.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Vnodes come from a slab cache shared by all volumes. sv_lock is
+ * created by the constructor and kept while the vnode is free.
+ */
+static struct slab_cache *sfs_vnodecache;
+
+static
+int
+sfs_vnode_ctor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+sfs_vnode_dtor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	lock_destroy(sv->sv_lock);
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Set up the vnode cache. Called on each mount; only the first call
+ * does anything.
+ */
+void
+sfs_inode_bootstrap(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_vnodecache != NULL) {
+		return;
+	}
+	sfs_vnodecache = slab_cache_create("sfs_vnode",
+					   sizeof(struct sfs_vnode),
+					   sfs_vnode_ctor, sfs_vnode_dtor);
+	if (sfs_vnodecache == NULL) {
+		panic("sfs: Could not create the vnode cache\n");
+	}
+}
+
+/*
+ * Write an on-disk inode structure back out to disk. Called with the
+ * vnode's sv_lock held, or from sfs_reclaim.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -55,11 +105,48 @@ sfs_sync_inode(struct sfs_vnode *sv)
 		if (result) {
 			return result;
 		}
+
+		/* Take it off the dirty list. */
+		spinlock_acquire(&sfs->sfs_dirtylock);
 		sv->sv_dirty = false;
+		if (sv->sv_dirtyprev != NULL) {
+			sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+		}
+		else {
+			KASSERT(sfs->sfs_dirtyvnodes == sv);
+			sfs->sfs_dirtyvnodes = sv->sv_dirtynext;
+		}
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+		}
+		sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+		spinlock_release(&sfs->sfs_dirtylock);
 	}
 	return 0;
 }
 
+/*
+ * Record that the in-memory inode has been modified, putting it on the
+ * dirty list of its volume if it isn't already.
+ */
+void
+sfs_markdirty(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (!sv->sv_dirty) {
+		sv->sv_dirty = true;
+		sv->sv_dirtyprev = NULL;
+		sv->sv_dirtynext = sfs->sfs_dirtyvnodes;
+		if (sfs->sfs_dirtyvnodes != NULL) {
+			sfs->sfs_dirtyvnodes->sv_dirtyprev = sv;
+		}
+		sfs->sfs_dirtyvnodes = sv;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,10 +157,14 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **pp;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Hold the vnode table lock throughout, so that sfs_loadvnode
+	 * can't find the vnode while it is being torn down.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
@@ -88,7 +179,7 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
@@ -97,7 +188,7 @@ sfs_reclaim(struct vnode *v)
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -105,7 +196,7 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -115,28 +206,25 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	KASSERT(!sv->sv_dirty);
+	pp = &sfs->sfs_vnodes[SFS_VHASH(sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
+		pp = &(*pp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*pp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
 
-	vnode_cleanup(&sv->sv_absvn);
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	sfs_dir_dropindex(sv);
+	vnode_cleanup(&sv->sv_absvn);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	slab_free(sfs_vnodecache, sv);
 
 	/* Done */
 	return 0;
@@ -144,39 +232,36 @@ sfs_reclaim(struct vnode *v)
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Takes the vnode table lock.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	for (sv = sfs->sfs_vnodes[SFS_VHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in unallocated "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+
 			/* forcetype is only allowed when creating objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_absvn);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -184,8 +269,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = slab_alloc(sfs_vnodecache);
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -198,7 +284,8 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		slab_free(sfs_vnodecache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -213,7 +300,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		/* (marked dirty below, once it belongs to the volume) */
 	}
 
 	/*
@@ -235,21 +322,31 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		slab_free(sfs_vnodecache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_dirindex = NULL;
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+	sv->sv_syncgen = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
+	sv->sv_hashnext = sfs->sfs_vnodes[SFS_VHASH(ino)];
+	sfs->sfs_vnodes[SFS_VHASH(ino)] = sv;
+	sfs->sfs_nvnodes++;
+
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_markdirty(sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -296,25 +393,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
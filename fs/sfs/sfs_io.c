@@ -53,17 +53,15 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block, retrying I/O errors. This goes to the device;
+ * everything else goes through the buffer cache.
  */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,33 +100,45 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block (through the buffer cache).
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buf->b_data, SFS_BLOCKSIZE);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block (into the buffer cache; it reaches the disk on sync
+ * or when the buffer is recycled).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buf->b_data, data, SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +160,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +171,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +183,33 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache (reading it in if it's
+	 * not there; even if we're writing, we must not clobber the
+	 * rest of the block).
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+	result = uiomove(buf->b_data+skipstart, len, uio);
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		/* The block reaches the disk on sync. */
+		sfs_buf_markdirty(buf);
 	}
 
-	return 0;
+	sfs_buf_release(buf);
+	return result;
 }
 
 /*
@@ -228,14 +220,12 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool doread = (uio->uio_rw==UIO_READ);
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,33 +248,96 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Do the I/O through the buffer cache, so that cached (and
+	 * possibly dirty) copies of the block are honored. A write
+	 * overwrites the whole block, so there is no need to read it.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
+	result = sfs_buf_get(sfs, diskblock, doread, &buf);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buf->b_data, SFS_BLOCKSIZE, uio);
+	if (result == 0 && !doread) {
+		sfs_buf_markdirty(buf);
+	}
 
+	sfs_buf_release(buf);
 	return result;
 }
 
+/*
+ * Read-ahead for a read of the file bytes [POS, ENDPOS).
+ *
+ * A read is sequential if it starts in the block where the previous
+ * one ended or in the next one. Each sequential read that reaches a new
+ * block grows the window; any other read shrinks it and restarts the
+ * read-ahead from its own position. The blocks of the read itself
+ * (beyond the first, which the caller is about to read anyway) and the
+ * next sv_rawindow blocks of the file are then queued on the disk,
+ * except those already read ahead, so they are transferred while the
+ * caller works through the first ones.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t first, last, from, to, fileblocks, fileblock;
+	daddr_t diskblock;
+	int result;
+
+	first = pos / SFS_BLOCKSIZE;
+	last = (endpos - 1) / SFS_BLOCKSIZE;
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		/* Sequential. */
+		if (last >= sv->sv_ranext) {
+			if (sv->sv_rawindow == 0) {
+				sv->sv_rawindow = SFS_RA_MINWINDOW;
+			}
+			else {
+				sv->sv_rawindow *= 2;
+			}
+			if (sv->sv_rawindow > SFS_RA_MAXWINDOW) {
+				sv->sv_rawindow = SFS_RA_MAXWINDOW;
+			}
+		}
+	}
+	else {
+		/* Random. */
+		sv->sv_rawindow /= 2;
+		sv->sv_raend = first + 1;
+	}
+	sv->sv_ranext = last + 1;
+
+	from = sv->sv_raend > first + 1 ? sv->sv_raend : first + 1;
+	to = last + 1 + sv->sv_rawindow;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (to > fileblocks) {
+		to = fileblocks;
+	}
+	if (to > from + 2 * SFS_RA_MAXWINDOW) {
+		/* Don't let a huge read flush its own blocks out of the cache. */
+		to = from + 2 * SFS_RA_MAXWINDOW;
+	}
+
+	for (fileblock = from; fileblock < to; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result) {
+			/* Not worth failing the read for; just stop. */
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_buf_readahead(sfs, diskblock);
+		}
+	}
+	if (to > sv->sv_raend) {
+		sv->sv_raend = to;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -316,6 +369,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			extraresid = endpos - size;
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
+			endpos = size;
+		}
+
+		if (SFS_RA_MAXWINDOW > 0 && uio->uio_resid > 0) {
+			sfs_readahead(sv, uio->uio_offset, endpos);
 		}
 	}
 
@@ -378,7 +436,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_markdirty(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -411,21 +469,10 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct sfs_buf *buf;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,32 +493,28 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, buf->b_data + blockoffset, len);
+		sfs_buf_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(buf->b_data + blockoffset, data, len);
+		sfs_buf_markdirty(buf);
+		sfs_buf_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_markdirty(sv);
 		}
 	}
 
@@ -31,17 +31,95 @@
 #define _SFSPRIVATE_H_
 
 #include <uio.h> /* for uio_rw */
+#include <vm.h> /* for PAGE_SIZE */
+#include <disksched.h> /* for struct diskreq */
 
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/*
+ * Buffer cache.
+ *
+ * Blocks of all the mounted volumes are cached in up to SFS_BUF_MAXFRAMES
+ * pages, allocated as needed and given back to the VM under memory
+ * pressure (SFS_BUFS_PER_FRAME blocks per page).
+ */
+#define SFS_BUF_MAXFRAMES	16
+#define SFS_BUFS_PER_FRAME	(PAGE_SIZE / SFS_BLOCKSIZE)
+#define SFS_BUF_HASHSIZE	64	/* must be a power of 2 */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume (NULL if the buffer is free) */
+	daddr_t b_block;		/* block number on the volume's device */
+	char *b_data;			/* SFS_BLOCKSIZE bytes of data */
+	unsigned b_refcount;		/* number of sfs_buf_get not released */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data must be written back */
+	bool b_busy;			/* I/O in progress */
+	bool b_readahead;		/* read ahead and not used yet */
+	time_t b_dirtysince;		/* when it became dirty (seconds) */
+	struct diskreq b_req;		/* for asynchronous I/O */
+	struct sfs_buf *b_hashnext;	/* next buffer in the hash bucket */
+	struct sfs_buf *b_lrunext;	/* LRU list of unreferenced buffers */
+	struct sfs_buf *b_lruprev;
+};
+
+/*
+ * Read-ahead.
+ *
+ * When a file is read sequentially, the blocks following each read are
+ * read into the buffer cache asynchronously. The window starts at
+ * SFS_RA_MINWINDOW blocks, doubles with each sequential read up to
+ * SFS_RA_MAXWINDOW, and is halved by each non-sequential one. Setting
+ * SFS_RA_MAXWINDOW to 0 disables read-ahead. It must stay well below the
+ * size of the cache, or blocks read ahead would push each other out.
+ */
+#define SFS_RA_MINWINDOW	2
+#define SFS_RA_MAXWINDOW	32
+
+/*
+ * Write-back.
+ *
+ * Dirty buffers are written by a kernel thread that wakes up every
+ * SFS_WB_INTERVAL seconds (changed with sfs_buf_setinterval) and writes
+ * the unused buffers that have been dirty for SFS_WB_MAXAGE seconds, or
+ * all of them when more than SFS_WB_DIRTYPCT percent of the cache is
+ * dirty. The writes are all queued at once, so the disk scheduler
+ * chains adjacent blocks into single transfers.
+ */
+#define SFS_WB_INTERVAL		1
+#define SFS_WB_MAXAGE		5
+#define SFS_WB_DIRTYPCT		50
+
+/*
+ * Reads and writes of user buffers are bounced through a kernel buffer
+ * of this many bytes, so that sv_lock is never held while user memory
+ * is touched (see sfs_userio). It is kept within the subpage sizes of
+ * kmalloc, so that getting it never means allocating (and perhaps
+ * evicting) a whole page.
+ */
+#define SFS_BOUNCESIZE		2048
+
+/* Bucket of an inode in the table of loaded vnodes */
+#define SFS_VHASH(ino)	((ino) & (SFS_VHASHSIZE - 1))
+
 /* Macro for initializing a uio structure */
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
+/* Functions in sfs_buf.c */
+void sfs_buf_bootstrap(void);
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool doread,
+		struct sfs_buf **ret);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_readahead(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_sync(struct sfs_fs *sfs);
+void sfs_buf_invalidate(struct sfs_fs *sfs);
+
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
@@ -58,11 +136,17 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+void sfs_writeback_meta(void);
+
 /* Functions in sfs_inode.c */
+void sfs_inode_bootstrap(void);
+void sfs_markdirty(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -71,6 +155,7 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
@@ -46,6 +46,7 @@ struct semaphore *sem_fork;
 #endif
 
 struct vnode;
+struct rwlock;
 
 
 /*
@@ -77,6 +78,7 @@ struct addrspace {
         Elf_Phdr prog_head_data;//Program header of the data section               
         struct vnode *v;        //vnode of the elf file                                 
         int valid;
+        struct rwlock *as_lock; //protects the regions: read by the fault path, written when they are defined
 #endif
 };
 
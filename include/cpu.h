@@ -35,6 +35,12 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of run queue priority levels (at most 8; see thread.c).
+ * Level 0 is the highest priority.
+ */
+#define RUNQUEUE_LEVELS 8
+
 
 /*
  * Per-cpu structure
@@ -67,9 +73,30 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[RUNQUEUE_LEVELS]; /* Run queues, by priority */
+	uint32_t c_runqueue_bits;	/* Bit L set if c_runqueue[L] is nonempty */
+	unsigned c_runqueue_count;	/* Threads on all the run queues */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Run queue latency statistics, by priority level.
+	 * Also protected by the runqueue lock.
+	 */
+	uint32_t c_rq_dispatches[RUNQUEUE_LEVELS]; /* Threads picked to run */
+	uint64_t c_rq_waitns[RUNQUEUE_LEVELS];	/* Total time they waited */
+	uint64_t c_rq_maxwaitns;	/* Longest wait */
+	uint32_t c_rq_boosts;		/* Periodic boosts of all threads */
+
+	/*
+	 * Load balancing statistics.
+	 * Also protected by the runqueue lock.
+	 */
+	uint32_t c_steals;		/* Times we took threads from others */
+	uint32_t c_stolen_in;		/* Threads taken from other cpus */
+	uint32_t c_stolen_out;		/* Threads other cpus took from us */
+	uint32_t c_steal_busy;		/* Steals given up: victim lock busy */
+	uint64_t c_idlens;		/* Time spent in cpu_idle */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
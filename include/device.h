@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct disksched;  /* in <disksched.h> */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -49,6 +50,7 @@ struct device {
 	dev_t d_devnumber;	/* serial number for this device */
 
 	void *d_data;		/* device-specific data */
+	struct disksched *d_sched; /* request queue (block devices), or NULL */
 };
 
 /*
@@ -77,6 +79,9 @@ struct vnode *dev_create_vnode(struct device *dev);
 /* Undo dev_create_vnode. */
 void dev_uncreate_vnode(struct vnode *vn);
 
+/* Request queue of the device behind a vnode, or NULL if it has none. */
+struct disksched *dev_getsched(struct vnode *vn);
+
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
@@ -0,0 +1,140 @@
+#ifndef _DISKSCHED_H_
+#define _DISKSCHED_H_
+
+/*
+ * Disk request scheduler.
+ *
+ * Sits between the VFS device layer and a block device driver. Callers
+ * submit requests (runs of consecutive blocks to or from a kernel
+ * buffer); the scheduler keeps the pending ones sorted by block and
+ * hands them to the driver one at a time in C-LOOK order, chaining
+ * requests that continue each other so they are transferred back to
+ * back.
+ *
+ * Requests can be waited for (disksched_submit) or just queued
+ * (disksched_start), in which case the caller can wait for them later
+ * with disksched_wait and/or be notified through a callback.
+ *
+ * The driver supplies a start function, called with ds_lock held, that
+ * begins the transfer of a request; when the transfer is over, the
+ * driver (typically its interrupt handler) calls disksched_done, also
+ * with ds_lock held, and the scheduler starts the next request.
+ */
+
+#include <kern/time.h>
+#include <spinlock.h>
+
+struct uio;	/* in <uio.h> */
+struct wchan;	/* in <wchan.h> */
+
+/*
+ * Largest request built by chaining adjacent requests (in blocks).
+ */
+#define DISKSCHED_MAXMERGE	64
+
+/*
+ * Reads can be favored over writes, since a thread (e.g. a page fault)
+ * is always blocked on a read, while writes are mostly evictions and
+ * write-backs. At most this many reads are then dispatched in a row
+ * while writes are waiting, so that writes cannot starve.
+ */
+#define DISKSCHED_READBATCH	8
+
+/*
+ * Largest transfer bounced through a kernel buffer when the caller's
+ * buffer cannot be handed to the driver (e.g. user space).
+ */
+#define DISKSCHED_MAXBOUNCE	4096
+
+/*
+ * A request.
+ */
+struct diskreq {
+	char *dr_buf;			/* Kernel buffer */
+	uint32_t dr_block;		/* First block */
+	uint32_t dr_nblocks;		/* Number of blocks */
+	bool dr_write;			/* Write (true) or read (false) */
+	bool dr_done;			/* Set when the request completes */
+	int dr_result;			/* Result of the request */
+	void (*dr_callback)(struct diskreq *, void *);
+					/* Called on completion, or NULL */
+	void *dr_cbarg;			/* Argument for dr_callback */
+	struct timespec dr_submitted;	/* When it was submitted */
+	struct diskreq *dr_link;	/* Next request in the queue */
+	struct diskreq *dr_chain;	/* Next request of the same transfer */
+};
+
+/*
+ * Per-device scheduler state.
+ */
+struct disksched {
+	char *ds_name;			/* Device name, for statistics */
+	void (*ds_start)(void *, struct diskreq *); /* Driver start function */
+	void *ds_drv;			/* Argument for ds_start */
+	uint32_t ds_blocksize;		/* Block size of the device */
+	bool ds_favorreads;		/* Dispatch reads before writes */
+
+	struct spinlock ds_lock;	/* Protects everything below */
+	struct wchan *ds_wchan;		/* Where callers wait for completion */
+	struct diskreq *ds_queue;	/* Pending requests, sorted by block */
+	struct diskreq *ds_active;	/* Request being transferred */
+	uint32_t ds_headpos;		/* Block after the last one dispatched */
+	unsigned ds_readbatch;		/* Reads dispatched in a row */
+	unsigned ds_depth;		/* Requests queued or in progress */
+
+	/* Statistics */
+	uint32_t ds_requests;		/* Requests completed */
+	uint32_t ds_blocks;		/* Blocks transferred */
+	uint32_t ds_dispatches;		/* Transfers started */
+	uint32_t ds_merged;		/* Requests chained to another one */
+	uint32_t ds_maxdepth;		/* Largest queue depth seen */
+	uint64_t ds_depthsum;		/* Sum of the depths seen on submit */
+	uint64_t ds_waitns;		/* Total time from submit to completion */
+	struct disksched *ds_next;	/* Next scheduler (for statistics) */
+};
+
+/*
+ * Set up a scheduler for a device. Returns an errno value.
+ */
+int disksched_init(struct disksched *ds, const char *name,
+		   uint32_t blocksize,
+		   void (*start)(void *drv, struct diskreq *req), void *drv);
+
+/*
+ * Queue a request without waiting for it. When it completes, its
+ * callback (if any) is called with ds_lock held, possibly from an
+ * interrupt handler, so it must not sleep. The request must stay
+ * allocated until it completes.
+ */
+void disksched_start(struct disksched *ds, struct diskreq *req);
+
+/*
+ * Wait for a request queued with disksched_start to complete. Returns
+ * the errno value of the request.
+ */
+int disksched_wait(struct disksched *ds, struct diskreq *req);
+
+/*
+ * Queue a request and wait for it to complete. Returns an errno value.
+ */
+int disksched_submit(struct disksched *ds, struct diskreq *req);
+
+/*
+ * Called by the driver, with ds_lock held, when REQ has completed with
+ * error code RESULT. Starts the next request, if any.
+ */
+void disksched_done(struct disksched *ds, struct diskreq *req, int result);
+
+/*
+ * Perform the I/O described by UIO: kernel buffers are submitted as
+ * they are, anything else is bounced through a kernel buffer. The
+ * uio must be block-aligned and within the device.
+ */
+int disksched_io(struct disksched *ds, struct uio *uio);
+
+/*
+ * Print queue depth and service time statistics for all devices.
+ */
+void disksched_printstats(void);
+
+#endif /* _DISKSCHED_H_ */
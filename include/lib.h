@@ -125,9 +125,13 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_bootstrap turns on the per-cpu caches of free blocks; it is
+ * called once curcpu is usable.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+void kheap_bootstrap(void);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
@@ -187,6 +191,12 @@ void kgets(char *buf, size_t maxbuflen);
 
 void kprintf_bootstrap(void);
 
+/*
+ * Boot options: leading name=value words of the kernel arguments
+ * (see main.c). bootarg_get returns NULL if NAME wasn't given.
+ */
+const char *bootarg_get(const char *name);
+
 /*
  * Other miscellaneous stuff
  */
@@ -48,27 +48,59 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Number of buckets of the table of loaded vnodes (a power of 2)
+ */
+#define SFS_VHASHSIZE 64
+
+struct sfs_dirindex;	/* private to sfs_dir.c */
+struct lock;		/* in <synch.h> */
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
+	struct lock *sv_lock;           /* protects sv_i and the file's blocks */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* next in the vnode table bucket */
+	struct sfs_vnode *sv_dirtynext; /* dirty list (if sv_dirty) */
+	struct sfs_vnode *sv_dirtyprev;
+	uint32_t sv_ranext;             /* block a sequential read would hit */
+	uint32_t sv_raend;              /* end of the blocks read ahead */
+	unsigned sv_rawindow;           /* blocks to read ahead (0: none) */
+	struct sfs_dirindex *sv_dirindex; /* name index (dirs; may be NULL) */
+	unsigned sv_syncgen;            /* last sfs_sync_vnodes pass */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Locking: the inode and blocks of a file (or directory) belong to its
+ * sv_lock; sfs_vnlock protects the table of loaded vnodes and
+ * sfs_freemaplock the freemap and superblock. The dirty list is under
+ * the spinlock sfs_dirtylock, since vnodes are marked dirty with their
+ * sv_lock held. When more than one is needed they are taken in the
+ * order: directory sv_lock, file sv_lock, sfs_vnlock, sfs_freemaplock.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct sfs_vnode *sfs_vnodes[SFS_VHASHSIZE];
+					/* vnodes loaded into memory, by inode */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct spinlock sfs_dirtylock;  /* protects the dirty list */
+	struct sfs_vnode *sfs_dirtyvnodes; /* vnodes with sv_dirty set */
+	unsigned sfs_syncgen;           /* sfs_sync_vnodes passes */
+	struct lock *sfs_freemaplock;   /* protects the freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_fs *sfs_next;        /* next mounted volume */
 };
 
 /*
@@ -76,5 +108,11 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print buffer cache statistics
+ */
+void sfs_buf_printstats(void);
+void sfs_buf_setinterval(unsigned seconds);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,50 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches ("slab allocator").
+ *
+ * A cache hands out objects of a single size, carved out of pages from
+ * alloc_kpages. Objects can have a constructor, run once when the page
+ * holding them is added to the cache, and a destructor, run when the
+ * page is given back. In between, a freed object keeps its constructed
+ * state (e.g. the locks and CVs it contains), so slab_alloc returns
+ * it as it was when it was last freed and the constructor work is
+ * not repeated on every allocation.
+ *
+ * Objects must be no larger than SLAB_MAXOBJ bytes.
+ */
+
+struct slab_cache;	/* Opaque */
+
+#define SLAB_MAXOBJ	1024
+
+/*
+ * Create a cache for objects of OBJSIZE bytes. CTOR (which returns an
+ * errno value) and DTOR may be NULL. Returns NULL if out of memory.
+ */
+struct slab_cache *slab_cache_create(const char *name, size_t objsize,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+
+/*
+ * Destroy a cache. All its objects must have been freed.
+ */
+void slab_cache_destroy(struct slab_cache *sc);
+
+/*
+ * Allocate an object, or return NULL if out of memory.
+ */
+void *slab_alloc(struct slab_cache *sc);
+
+/*
+ * Free an object allocated from SC.
+ */
+void slab_free(struct slab_cache *sc, void *obj);
+
+/*
+ * Print per-cache utilization.
+ */
+void slab_printstats(void);
+
+#endif /* _SLAB_H_ */
@@ -51,12 +51,22 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A fair spinlock is a ticket lock: each CPU that wants it takes a
+ * ticket (splk_next) and waits for the lock (now the number being
+ * served) to reach that number, so it is handed out in arrival order
+ * and a CPU can't be starved by others that keep getting it first.
+ * Waiters back off exponentially while there are others ahead of
+ * them, instead of all hammering the same word. Fair locks are used
+ * the same way as ordinary ones, and are meant for contended locks.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Fair locks: next ticket. */
+	bool splk_fair;			    /* Fair (ticket) lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
@@ -65,28 +75,40 @@ struct spinlock {
  * Initializer for cases where a spinlock needs to be static or global.
  */
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, false, NULL, \
+				  HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_FAIR_INITIALIZER { SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, true, NULL, \
 				  HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, false, NULL }
+#define SPINLOCK_FAIR_INITIALIZER { SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, true, NULL }
 #endif
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_fair	Initialize the contents of a fair spinlock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * tryacquire	Get the lock if it is free and return true; otherwise
+ *		return false at once.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_fair(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
@@ -0,0 +1,110 @@
+#ifndef _SWAPCACHE_H_
+#define _SWAPCACHE_H_
+
+#include "types.h"
+#include "lib.h"
+#include "spinlock.h"
+#include "synch.h"
+#include "vm.h"
+
+#define SWAP_CACHE_FRAMES 16 //Number of RAM frames holding compressed pages
+#define SWAP_CACHE_CHUNK 128 //Allocation unit inside a frame (bytes)
+#define SWAP_CACHE_CHUNKS (PAGE_SIZE/SWAP_CACHE_CHUNK) //Number of chunks in a frame (at most 32, one bit each in usedMask)
+#define SWAP_CACHE_ENTRIES (SWAP_CACHE_FRAMES*SWAP_CACHE_CHUNKS) //Maximum number of pages in the cache (one chunk each)
+#define SWAP_CACHE_MAX_CSIZE (PAGE_SIZE/2) //Pages compressing worse than this go to the disk
+#define SWAP_CACHE_HASH_SIZE 1024 //Size of the hash table used by the compressor (must be a power of 2)
+#define SWAP_CACHE_WORKERS 4 //Pages that can be compressed at the same time (one work area each)
+
+/**
+ * Location of a compressed page inside the pool
+ */
+struct swapCacheEntry{
+    int16_t frame; //Frame of the pool holding the page, -1 if the entry is not used
+    uint8_t firstChunk; //First chunk of the page inside the frame
+    uint8_t nChunks; //Number of contiguous chunks used by the page
+    uint16_t csize; //Size of the compressed page (bytes)
+};
+
+/**
+ * Work memory of the compressor. Each page is compressed in a work area of its own, outside
+ * cacheLock, and only the result is copied in the pool holding the lock
+ */
+struct swapCacheWork{
+    uint16_t hashTable[SWAP_CACHE_HASH_SIZE]; //Hash table of the compressor
+    uint8_t cbuf[SWAP_CACHE_MAX_CSIZE]; //Compressed page, before it is copied in the pool
+};
+
+/**
+ * Compressed in-RAM swap cache: a bounded pool of frames in front of the swap devices
+ */
+struct swapCache{
+    void *frames[SWAP_CACHE_FRAMES]; //Frames of the pool
+    uint32_t usedMask[SWAP_CACHE_FRAMES]; //One bit per chunk of each frame, set if the chunk is in use
+    struct swapCacheEntry entries[SWAP_CACHE_ENTRIES]; //One entry per page that can be cached
+    struct swapCacheWork *work[SWAP_CACHE_WORKERS]; //Work areas of the compressor
+    uint32_t workFree; //One bit per work area, set if it is free (protected by cacheLock)
+    struct semaphore *workSem; //Counts the free work areas
+    struct spinlock cacheLock; //Protects the allocation of the pool and of the work areas (never held while sleeping)
+
+    struct spinlock statsLock; //Protects the counters below
+    uint32_t stores; //Pages offered to the cache
+    uint32_t storesCached; //Pages stored in the cache
+    uint32_t rejectedSize; //Pages not cached because they compress badly
+    uint32_t rejectedFull; //Pages not cached because the pool is full
+    uint32_t loads; //Pages read back from the swap area (cache or disk)
+    uint32_t hits; //Pages read back from the cache
+    uint64_t bytesIn; //Bytes of the pages stored in the cache
+    uint64_t bytesOut; //Bytes of the compressed pages stored in the cache
+};
+
+/**
+ * This function sets up the compressed swap cache, allocating the frames of the pool.
+*/
+void initSwapCache(void);
+
+/**
+ * This function compresses a page and stores it in the cache. It may sleep waiting for a work area.
+ *
+ * @param int: cache entry that will hold the page
+ * @param const void *: kernel address of the page
+ *
+ * @return 0 if the page was cached, -1 if it compresses badly or the pool is full
+*/
+int swapCacheStore(int, const void *);
+
+/**
+ * This function decompresses a page from the cache. The entry remains valid.
+ *
+ * @param int: cache entry holding the page
+ * @param void *: kernel address of the destination page
+*/
+void swapCacheLoad(int, void *);
+
+/**
+ * This function copies a cached page into another entry, without decompressing it (used by fork).
+ *
+ * @param int: destination cache entry
+ * @param int: source cache entry
+ *
+ * @return 0 on success, -1 if the pool is full
+*/
+int swapCacheCopy(int, int);
+
+/**
+ * This function releases the space used by a cache entry.
+ *
+ * @param int: cache entry
+*/
+void swapCacheFree(int);
+
+/**
+ * Records a page read back from the swap area (hit = 1 if it was found in the cache).
+*/
+void swapCacheCountLoad(int);
+
+/**
+ * Prints hit rate, compression ratio and the disk I/O avoided by the cache.
+*/
+void printSwapCacheStatistics(void);
+
+#endif /* _SWAPCACHE_H_ */
@@ -4,6 +4,8 @@
 #include "types.h"
 #include "addrspace.h"
 #include "kern/fcntl.h"
+#include "kern/errno.h"
+#include "stat.h"
 #include "uio.h"
 #include "vnode.h"
 #include "copyinout.h"
@@ -16,31 +18,94 @@
 #include "opt-debug.h"
 #include "spl.h"
 #include "current.h"
+#include "bitmap.h"
+#include "clock.h"
+#include "swapcache.h"
+#include "device.h"
+#include "disksched.h"
+#include "wchan.h"
+
+#define SWAP_MAP_LOAD 2 //Maximum number of slots per swap map bucket, on average (the number of buckets is a power of 2)
+#define SWAP_NONE (-1) //Marks the end of a chain of swap slots
+#define SWAP_ZERO_ENTRIES 512 //Maximum number of all-zero pages recorded in the swap map without a slot
+#define SWAP_MAX_DEVICES 4 //Maximum number of swap devices
+#define SWAP_DEVICES_ARG "swap" //Boot option listing the swap devices (e.g. swap=lhd0,lhd1), no swap device if missing
+#define SWAP_SIZE_ARG "swapsize" //Boot option bounding the swap area on each device (bytes, K or M suffix), the whole device if missing
+#define SWAP_COPY_BUFFERS 2 //Pages being written at the same time while duplicating the swap pages of a process (fork)
+#define SWAP_IO_BUCKETS 64 //Number of buckets of in-flight writes, each with its own wait channel (must be a power of 2)
+
+/**
+ * Swap device: slots [firstSlot, firstSlot+nSlots) of the swap area are stored on it
+ */
+struct swapDevice{
+    char name[16]; //Device name (e.g. lhd0)
+    struct vnode *v; //vnode of the raw device
+    struct disksched *sched; //Request queue of the device, swap I/O bypasses VOP_READ/VOP_WRITE
+    int firstSlot; //First slot stored on the device
+    int nSlots; //Number of slots stored on the device
+    struct bitmap *freeMap; //Slot allocator: one bit per slot of the device, set if the slot is in use
+    struct spinlock statsLock; //Protects the counters below
+    uint32_t pagesRead; //Number of pages read from the device
+    uint32_t pagesWritten; //Number of pages written to the device
+    struct timespec ioTime; //Time spent performing I/O on the device
+};
+
+/**
+ * Bucket of writes in progress: writes are hashed by slot, so a load only scans the writes
+ * of its bucket and a completion only wakes up the processes waiting on the same bucket
+ */
+struct swapIOBucket{
+    struct swapIORequest *inflight; //Writes in progress on the slots of the bucket
+    struct spinlock lock; //Protects inflight (taken by the completion callback, so it is a spinlock)
+    struct wchan *wchan; //Used to wait for the completion of the writes in inflight
+};
 
 /**
- * Swapfile data structure
+ * Swapfile data structure.
+ * Slots [0, sizeSF) are stored on the swap devices, slots [sizeSF, sizeSF+SWAP_CACHE_ENTRIES)
+ * are RAM slots, whose pages are held compressed by the swap cache. The following SWAP_ZERO_ENTRIES
+ * are zero entries: they record all-zero pages, which have no content to store.
  */
 struct swapFile{
-    struct swapPage **textPages; // Array of lists containing text pages in the swap file (one list per PID)
-    struct swapPage **dataPages; // Array of lists containing data pages in the swap file (one list per PID)
-    struct swapPage **stackPages; // Array of lists containing stack pages in the swap file (one list per PID)
-    struct swapPage *freePages; // List of available (free) pages in the swap file
-    void *kbuf;//Buffer for copying of swap pages
-    struct vnode *v; //vnode swapfile
-    int sizeSF; //Number of pages stored in the swapfile
+    struct swapPage **pages; // Slot descriptors (one per disk slot, RAM slot or zero entry), in page-sized chunks: see SLOT_PAGE
+    int *swapMap; // Swap map: hash on (PID, VPN), each bucket holds the first slot of a chain
+    unsigned mapMask; // Number of buckets of the swap map minus one (it's sized from the number of slots)
+    int *procPages; // Array of slot chains containing the pages of each process in the swap file (one chain per PID)
+    struct swapDevice devices[SWAP_MAX_DEVICES]; // Devices holding the swap area
+    int nDevices; // Number of swap devices in use
+    int nextDevice; // Device used for the next allocation (slots are interleaved across devices)
+    struct bitmap *cacheMap; // RAM slot allocator: one bit per swap cache entry, set if the entry is in use
+    struct bitmap *zeroMap; // Zero entry allocator: one bit per zero entry, set if the entry is in use
+    struct swapIOBucket ioBuckets[SWAP_IO_BUCKETS]; // Writes in progress, hashed by slot: a slot can't be read back until its write completes
+    void *kbuf[SWAP_COPY_BUFFERS]; //Buffers for copying of swap pages
+    struct swapIORequest *copyReqs; //Requests writing the buffers in kbuf
+    int sizeSF; //Number of pages stored in the swapfile (on all the devices)
 };
 
 /**
- * Info on a single page of the swapfile
+ * Info on a single page (slot) of the swapfile.
+ * The position of the page within the swap file is given by its slot number.
 */
 struct swapPage{
     vaddr_t vaddr; //Virtual address of the stored page
-    int isStoreOp; // Flag indicating whether a store operation is being performed on a specific page
-    struct swapPage *next; // Pointer to the next page in the list
-    paddr_t swapOffset; // Position of the swap element within the swap file
-    struct cv *operationCV; // Used to wait for the completion of the store operation
-    struct lock *operationLock; // Required to safely perform cv_wait
+    pid_t pid; //Process owning the slot (0 if the slot is free)
+    int next; // Next slot in the same swap map bucket
+    int procNext; // Next slot of the same process
+    int procPrev; // Previous slot of the same process
+};
 
+/**
+ * Asynchronous transfer of a page between memory and a swap slot.
+ * The request must stay allocated until it completes.
+*/
+struct swapIORequest{
+    struct diskreq req; //Request queued on the device
+    struct swapDevice *dev; //Device holding the slot
+    int slot; //Swap slot
+    struct timespec start; //Submission time, for the I/O time of the device
+    void (*callback)(struct swapIORequest *, void *); //Called on completion, from the interrupt handler (it must not sleep), may be NULL
+    void *arg; //Argument of the callback
+    struct swapIORequest *next; //Next write in the same bucket of sf->ioBuckets
 };
 
 /**
@@ -56,7 +121,7 @@ int loadSwapFrame(vaddr_t, pid_t, paddr_t);
 
 /**
  * This function writes a frame into the swap file.
- * If the swap file size exceeds 9MB, it triggers a kernel panic.
+ * If all the swap devices are full, it triggers a kernel panic.
  *
  * @param vaddr_t: virtual address that triggered the page fault
  * @param pid_t: process ID
@@ -67,10 +132,40 @@ int loadSwapFrame(vaddr_t, pid_t, paddr_t);
 int storeSwapFrame(vaddr_t, pid_t, paddr_t);
 
 /**
- * This function sets up the swap file. Specifically, it allocates the necessary data structures and opens the file that will hold the pages.
+ * This function starts the transfer of a page between memory and a swap slot, without waiting for it.
+ * Until the transfer of a write completes, loads of the slot wait for it.
+ *
+ * @param struct swapIORequest *: request, it must stay allocated until it completes
+ * @param int: swap slot (stored on a device)
+ * @param void *: kernel address of the page
+ * @param enum uio_rw: UIO_READ to load the page from the slot, UIO_WRITE to store it
+ * @param callback: function called on completion (from the interrupt handler, it must not sleep), may be NULL
+ * @param void *: argument of the callback
+*/
+void swapIOSubmit(struct swapIORequest *, int, void *, enum uio_rw,
+                  void (*)(struct swapIORequest *, void *), void *);
+
+/**
+ * This function waits for the completion of a transfer started with swapIOSubmit.
+ *
+ * @param struct swapIORequest *: request
+ *
+ * @return 0 on success, the error code of the device otherwise
+*/
+int swapIOWait(struct swapIORequest *);
+
+/**
+ * This function sets up the swap file. Specifically, it opens the swap devices and allocates the necessary data structures.
+ * The devices are taken from the SWAP_DEVICES_ARG boot option, and the size of the swap area on each
+ * of them is the size of the device (optionally bounded by the SWAP_SIZE_ARG boot option).
 */
 int initSwapfile(void);
 
+/**
+ * Prints, for each swap device, the number of pages transferred and the throughput.
+*/
+void printSwapDevices(void);
+
 
 /**
  * When a process ends, we free all its pages stored in the swap file.
@@ -88,16 +183,10 @@ void freeProcessPagesInSwap(pid_t);
 void duplicateSwapPages(pid_t, pid_t);
 
 /**
- * (DEBUG) Given the process ID, it prints the text, data, and stack lists.
+ * (DEBUG) Given the process ID, it prints the pages it owns in the swap file.
  * 
  * @param pid_t: process ID of the target process.
 */
 void printPageLists(pid_t);
 
-/**
- * After the entire program finishes, we reorder all the pages in the swap file.
- * Since lower offsets result in faster I/O, this function helps maintain performance.
-*/
-void optimizeSwapfile(void);
-
 #endif /* _SWAPFILE_H_ */
\ No newline at end of file
@@ -37,6 +37,7 @@
 
 
 #include <spinlock.h>
+#include <kern/time.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -72,7 +73,15 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * An adaptive lock is for locks only held briefly: a thread that
+ * finds it held by a thread running on another CPU spins for a while
+ * waiting for it to be released, instead of going to sleep at once.
+ *
+ * Contention is counted per lock name (see lock_printstats).
  */
+struct lockstat;
+
 struct lock {
         char *lk_name;
         // add what you need here
@@ -80,9 +89,13 @@ struct lock {
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
         volatile struct thread *lk_owner;
+	bool lk_adaptive;		/* spin before sleeping */
+	struct lockstat *lk_stats;	/* counters for this name, or NULL */
+	struct timespec lk_acquiretime;	/* for hold times, if timed */
 };
 
 struct lock *lock_create(const char *name);
+struct lock *lock_create_adaptive(const char *name);
 void lock_destroy(struct lock *);
 
 /*
@@ -100,6 +113,17 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Lock statistics:
+ *    lock_settiming   - Start or stop counting acquisitions and hold
+ *                       times (which reads the clock on every
+ *                       acquire and release). Off at boot.
+ *    lock_printstats  - Print, by lock name, how often locks were
+ *                       contended, spun on, and slept on.
+ */
+void lock_settiming(bool on);
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -144,4 +168,66 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * until it has had its turn, so a steady stream of readers cannot
+ * starve writers out.
+ *
+ * Readers take and drop the lock with a single atomic update of
+ * rw_state, so readers on different CPUs don't serialize on anything;
+ * rw_lock is only taken to sleep and to wake sleepers.
+ *
+ * struct rwlock sleeps while waiting; struct rwspinlock spins (and,
+ * like a spinlock, disables interrupts while held), for short
+ * critical sections and for where sleeping is not allowed.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rw_name;
+	volatile spinlock_data_t rw_state;	/* readers, writer, waiting */
+	struct spinlock rw_lock;		/* for sleeping */
+	struct wchan *rw_readwchan;		/* readers sleep here */
+	struct wchan *rw_writewchan;		/* writers sleep here */
+	struct thread *rw_writer;		/* holder, if writing */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+struct rwspinlock {
+	volatile spinlock_data_t rws_state;	/* as rw_state */
+};
+
+void rwspinlock_init(struct rwspinlock *);
+void rwspinlock_cleanup(struct rwspinlock *);
+
+/*
+ * Operations (the same for both kinds):
+ *    acquire_read  - Get the lock for reading. Waits while a writer
+ *                    holds it or is waiting for it.
+ *    release_read  - Drop a read hold.
+ *    acquire_write - Get the lock for writing. Waits until no one
+ *                    else holds it.
+ *    release_write - Drop a write hold.
+ *    do_i_hold_write - Return true if the current thread holds the
+ *                    lock for writing (rwlock only; readers aren't
+ *                    tracked).
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+void rwspinlock_acquire_read(struct rwspinlock *);
+void rwspinlock_release_read(struct rwspinlock *);
+void rwspinlock_acquire_write(struct rwspinlock *);
+void rwspinlock_release_write(struct rwspinlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -66,6 +66,7 @@ void sys__exit(int status);
 int sys_waitpid(pid_t pid, userptr_t statusp, int options);
 pid_t sys_getpid(void);
 #if OPT_FORK
+void sys_fork_bootstrap(void);
 int sys_fork(struct trapframe *ctf, pid_t *retval);
 #endif
 
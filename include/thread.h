@@ -36,6 +36,7 @@
  * Note: curthread is defined by <current.h>.
  */
 
+#include <kern/time.h>
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
@@ -85,6 +86,16 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduling fields. Protected by the runqueue lock of t_cpu
+	 * while the thread is running or runnable, and by the wchan
+	 * lock while it is asleep.
+	 */
+	unsigned t_priority;		/* Run queue level (0 is highest) */
+	unsigned t_ticks;		/* Ticks run at this level */
+	struct timespec t_readytime;	/* When it was last made runnable */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when it last ran */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -131,6 +142,13 @@ void thread_panic(void);
 /* Call during system shutdown to offline other CPUs. */
 void thread_shutdown(void);
 
+/*
+ * Set how many exited threads (with their stacks) are kept for reuse,
+ * and print how often thread creation was served from them.
+ */
+void thread_pool_setmax(unsigned max);
+void thread_pool_printstats(void);
+
 /*
  * Make a new thread, which will start executing at "func". The thread
  * will belong to the process "proc", or to the current thread's
@@ -158,11 +176,25 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a clock tick to the current thread, and switch to another
+ * thread if it should be preempted. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Choose between the multi-level feedback queue scheduler (true, the
+ * default) and plain round-robin (false), and print run queue
+ * latency statistics.
+ */
+void thread_sched_setmlfq(bool mlfq);
+void thread_sched_printstats(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
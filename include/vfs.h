@@ -56,6 +56,7 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_getcurdir - retrieve vnode of current directory of current thread
  *    vfs_sync      - force all dirty buffers to disk
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
+ *                    (with vfs_devlock held)
  *    vfs_getdevname - get mounted device name for the filesystem passed in
  */
 
@@ -183,6 +184,33 @@ int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Name cache (vfsnamecache.c). It has its own lock; only
+ * vfs_nc_purgefs must be called with vfs_biglock held.
+ *
+ *    vfs_nc_lookup   - Look up a single path component in a directory.
+ *                      Returns true if the answer is cached, in which
+ *                      case RESULT is the vnode (referenced) or NULL if
+ *                      the name does not exist; otherwise GEN is set
+ *                      for vfs_nc_enter.
+ *
+ *    vfs_nc_enter    - Cache the result of a lookup (VN NULL: ENOENT),
+ *                      unless a name was removed since vfs_nc_lookup
+ *                      returned GEN.
+ *
+ *    vfs_nc_remove   - Forget a name; call after changing what it names.
+ *
+ *    vfs_nc_purgefs  - Forget all names of a file system (for unmount).
+ */
+void vfs_nc_bootstrap(void);
+bool vfs_nc_lookup(struct vnode *dir, const char *name,
+		   struct vnode **result, unsigned *gen);
+void vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  unsigned gen);
+void vfs_nc_remove(struct vnode *dir, const char *name);
+void vfs_nc_purgefs(struct fs *fs);
+void vfs_nc_printstats(void);
+
 /*
  * Array of vnodes.
  */
@@ -201,5 +229,16 @@ void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
 bool vfs_biglock_do_i_hold(void);
 
+/*
+ * Reader-writer lock for the list of known devices and the boot
+ * filesystem vnode, so that path lookups, which only read them, don't
+ * serialize on vfs_biglock. Whatever changes them holds vfs_biglock
+ * too, and takes this after it.
+ */
+void vfs_devlock_acquire_read(void);
+void vfs_devlock_release_read(void);
+void vfs_devlock_acquire_write(void);
+void vfs_devlock_release_write(void);
+
 
 #endif /* _VFS_H_ */
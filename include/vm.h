@@ -55,6 +55,15 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Kernel caches that can give pages back under memory pressure (e.g.
+ * the SFS buffer cache) register a reclaim function, which frees up to
+ * NPAGES of their pages without sleeping and returns how many it freed.
+ * vm_reclaim is called when no frame is available, before waiting.
+ */
+void vm_register_reclaim(int (*reclaim)(unsigned npages));
+int vm_reclaim(unsigned npages);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -3,9 +3,9 @@
 
 #include <types.h>
 #include <lib.h>
-#include <spinlock.h>
+#include <platform/maxcpus.h>
 
-// Stats types
+// Stats types (also the index of each counter in struct statistics_cpu)
 #define FAULT 0
 #define FAULT_WITH_FREE 1
 #define FAULT_WITH_REPLACE 2
@@ -16,39 +16,39 @@
 #define FAULT_FROM_ELF 7
 #define FAULT_FROM_SWAPFILE 8
 #define SWAPFILE_WRITES 9
-
-// Structure for TLB statistics
-struct statistics_tlb {
-    uint32_t tlb_faults;
-    uint32_t tlb_faults_with_free;
-    uint32_t tlb_faults_with_replace;
-    uint32_t tlb_invalidations;
-    uint32_t tlb_reloads;
-    struct spinlock lock; 
-};
-
-// Structure for PT statistics
-struct statistics_pt {
-    uint32_t pt_faults_zeroed;
-    uint32_t pt_faults_disk;
-    uint32_t pt_faults_from_elf;
-    uint32_t pt_faults_from_swapfile;
-    uint32_t pt_swapfile_writes;
-    struct spinlock lock; 
-};
+#define SWAP_ZERO_PAGES 10
+#define FAULT_SWAP_ZERO 11
+#define FAULT_FROM_SWAPCACHE 12
+#define NUM_STATISTICS 13
+
+#define STATISTICS_CACHE_LINE 64 // Size of a cache line
+
+// Per-CPU counters. Each CPU only updates its own entry (with interrupts off,
+// so no lock is needed); readers sum the entries of all the CPUs.
+//   TLB counters: FAULT .. RELOAD
+//   PT counters: FAULT_ZEROED .. FAULT_FROM_SWAPFILE, FAULT_SWAP_ZERO (faults on
+//     all-zero swapped pages, a subset of FAULT_ZEROED) and FAULT_FROM_SWAPCACHE
+//     (faults served by the compressed swap cache, without disk I/O)
+//   Swap counters: SWAPFILE_WRITES, and SWAP_ZERO_PAGES (all-zero pages recorded
+//     in the swap map without I/O)
+// Each entry is aligned (and so padded) to a cache line, so that the counters of
+// different CPUs never share a line.
+// Readers don't lock either: they re-read each 64-bit counter until two reads
+// agree, so as not to see it torn halfway through an increment (see readCounter).
+struct statistics_cpu {
+    uint64_t counters[NUM_STATISTICS];
+} __attribute__((__aligned__(STATISTICS_CACHE_LINE)));
 
 // Global variables
-extern struct statistics_tlb statistics_tlb;
-extern struct statistics_pt statistics_pt;
+extern struct statistics_cpu statistics_cpus[MAXCPUS];
 
 // Function prototypes
 void initializeStatistics(void);
 void incrementStatistics(int type);
-uint32_t returnTLBStatistics(int type);
-uint32_t returnPTStatistics(int type);
-uint32_t returnSWStatistics(int type);
-void constraintsCheck(uint32_t faults, uint32_t free, uint32_t replace, uint32_t reload, uint32_t disk, uint32_t zeroed, uint32_t elf, uint32_t swapfile);
+uint64_t returnTLBStatistics(int type);
+uint64_t returnPTStatistics(int type);
+uint64_t returnSWStatistics(int type);
+void constraintsCheck(uint64_t faults, uint64_t free, uint64_t replace, uint64_t reload, uint64_t disk, uint64_t zeroed, uint64_t swapcache, uint64_t elf, uint64_t swapfile);
 void printStatistics(void);
 
 #endif
-
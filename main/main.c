@@ -123,6 +123,10 @@ boot(void)
 	ram_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
+	kheap_bootstrap();
+	#if OPT_FORK
+	sys_fork_bootstrap();
+	#endif
 	hardclock_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
@@ -222,6 +226,81 @@ sys_reboot(int code)
 	return 0;
 }
 
+/*
+ * Boot options.
+ *
+ * The kernel arguments may begin with words of the form name=value,
+ * e.g. "swap=lhd1 swapsize=4M; p /testbin/sort". These are taken out
+ * before the rest of the string is handed to the menu, and can be
+ * looked up with bootarg_get() from boot() onwards.
+ */
+
+#define MAXBOOTARGS 8
+
+static struct {
+	const char *name;
+	const char *value;
+} bootargs[MAXBOOTARGS];
+static unsigned numbootargs;
+
+static
+bool
+bootarg_issep(char c)
+{
+	return c == ' ' || c == '\t' || c == ';';
+}
+
+/*
+ * Split the leading name=value words off ARGS and return what is left.
+ */
+static
+char *
+bootargs_parse(char *args)
+{
+	char *word, *eq;
+
+	while (numbootargs < MAXBOOTARGS) {
+		while (bootarg_issep(*args)) {
+			args++;
+		}
+		word = args;
+		while (*args != 0 && !bootarg_issep(*args)) {
+			args++;
+		}
+
+		for (eq = word; eq < args && *eq != '='; eq++);
+		if (eq == word || eq == args) {
+			/* Not an option: the commands start here */
+			return word;
+		}
+
+		if (*args != 0) {
+			*args++ = 0;
+		}
+		*eq = 0;
+		bootargs[numbootargs].name = word;
+		bootargs[numbootargs].value = eq + 1;
+		numbootargs++;
+	}
+	return args;
+}
+
+/*
+ * Return the value of boot option NAME, or NULL if it wasn't given.
+ */
+const char *
+bootarg_get(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<numbootargs; i++) {
+		if (!strcmp(bootargs[i].name, name)) {
+			return bootargs[i].value;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Kernel main. Boot up, then fork the menu thread; wait for a reboot
  * request, and then shut down.
@@ -229,6 +308,8 @@ sys_reboot(int code)
 void
 kmain(char *arguments)
 {
+	arguments = bootargs_parse(arguments);
+
 	boot();
 
 	menu(arguments);
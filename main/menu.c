@@ -40,6 +40,8 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <disksched.h>
+#include <slab.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -141,8 +143,6 @@ common_prog(int nargs, char **args)
 
 		KASSERT(pid == ret_pid);
 
-		optimizeSwapfile();
-
 		kprintf("Thread exited with code %d\n",exit);
 
 	}
@@ -470,10 +470,159 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	slab_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	disksched_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_nc_printstats();
 
 	return 0;
 }
 
+static
+int
+cmd_threadpoolstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_pool_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_threadpoolmax(int nargs, char **args)
+{
+	int max;
+
+	if (nargs != 2) {
+		kprintf("Usage: tpmax threads\n");
+		return EINVAL;
+	}
+
+	max = atoi(args[1]);
+	if (max < 0) {
+		kprintf("tpmax: cannot keep a negative number of threads\n");
+		return EINVAL;
+	}
+
+	thread_pool_setmax(max);
+
+	return 0;
+}
+
+static
+int
+cmd_runqueuestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_sched_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	if (nargs != 2 ||
+	    (strcmp(args[1], "mlfq") && strcmp(args[1], "rr"))) {
+		kprintf("Usage: sched mlfq|rr\n");
+		return EINVAL;
+	}
+
+	thread_sched_setmlfq(!strcmp(args[1], "mlfq"));
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_locktiming(int nargs, char **args)
+{
+	if (nargs != 2 ||
+	    (strcmp(args[1], "on") && strcmp(args[1], "off"))) {
+		kprintf("Usage: lktime on|off\n");
+		return EINVAL;
+	}
+
+	lock_settiming(!strcmp(args[1], "on"));
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_buf_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_wbinterval(int nargs, char **args)
+{
+	int seconds;
+
+	if (nargs != 2) {
+		kprintf("Usage: wb seconds\n");
+		return EINVAL;
+	}
+
+	seconds = atoi(args[1]);
+	if (seconds <= 0) {
+		kprintf("wb: interval must be at least one second\n");
+		return EINVAL;
+	}
+
+	sfs_buf_setinterval(seconds);
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -569,6 +718,8 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc throughput test       ",
+	"[slt] Spinlock throughput/fairness  ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -610,6 +761,18 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[ds] Disk scheduler stats           ",
+	"[nc] VFS name cache stats           ",
+	"[tp] Thread pool stats              ",
+	"[tpmax] Set thread pool size        ",
+	"[rq] Run queue stats                ",
+	"[sched] Set scheduler (mlfq|rr)     ",
+	"[lk] Lock contention stats          ",
+	"[lktime] Time lock holds (on|off)   ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+	"[wb] Set SFS write-back interval    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -661,6 +824,18 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "ds",         cmd_diskstats },
+	{ "nc",         cmd_ncstats },
+	{ "tp",         cmd_threadpoolstats },
+	{ "tpmax",      cmd_threadpoolmax },
+	{ "rq",         cmd_runqueuestats },
+	{ "sched",      cmd_sched },
+	{ "lk",         cmd_lockstats },
+	{ "lktime",     cmd_locktiming },
+#if OPT_SFS
+	{ "bc",         cmd_bufstats },
+	{ "wb",         cmd_wbinterval },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -671,6 +846,8 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "slt",	spinlocktest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
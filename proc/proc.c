@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
@@ -50,12 +51,13 @@
 #include <vnode.h>
 
 #include <synch.h>
+#include <slab.h>
 
 static struct _processTable {
   int active;           /* initial value 0 */
   struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
   int last_i;           /* index of last allocated pid */
-  struct spinlock lk;	/* Lock for this table */
+  struct rwspinlock lk;	/* Lock for this table (read-mostly) */
 } processTable;
 
 /*
@@ -63,6 +65,41 @@ static struct _processTable {
  */
 struct proc *kproc;
 
+/*
+ * Proc structures come from a slab cache. p_cv and lock are created
+ * by the constructor and survive in free structures, so that fork
+ * doesn't have to create them every time.
+ */
+static struct slab_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_cv = cv_create("proc");
+	if (proc->p_cv == NULL) {
+		return ENOMEM;
+	}
+	proc->lock = lock_create("proc");
+	if (proc->lock == NULL) {
+		cv_destroy(proc->p_cv);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	cv_destroy(proc->p_cv);
+	lock_destroy(proc->lock);
+}
+
 /*
  * G.Cabodi - 2019
  * Initialize support for pid/waitpid.
@@ -71,7 +108,9 @@ struct proc *
 proc_search_pid(pid_t pid) {
   struct proc *p;
   KASSERT(pid>=1&&pid<=MAX_PROC);
+  rwspinlock_acquire_read(&processTable.lk);
   p = processTable.proc[pid];
+  rwspinlock_release_read(&processTable.lk);
   KASSERT(p->p_pid==pid);
   return p;
 }
@@ -81,10 +120,10 @@ proc_search_pid(pid_t pid) {
  * Initialize support for pid/waitpid.
  */
 static void
-proc_init_waitpid(struct proc *proc, const char *name) {
+proc_init_waitpid(struct proc *proc) {
   /* search a free index in table using a circular strategy */
   int i;
-  spinlock_acquire(&processTable.lk);
+  rwspinlock_acquire_write(&processTable.lk);
   i = processTable.last_i+1;
   proc->p_pid = 0;
   if (i>MAX_PROC) i=1;
@@ -98,13 +137,11 @@ proc_init_waitpid(struct proc *proc, const char *name) {
     i++;
     if (i>MAX_PROC) i=1;
   }
-  spinlock_release(&processTable.lk);
+  rwspinlock_release_write(&processTable.lk);
   if (proc->p_pid==0) {
     panic("too many processes. proc table is full\n");
   }
   proc->p_status = 0;
-  proc->p_cv = cv_create(name);
-  proc->lock = lock_create(name);
 }
 
 /*
@@ -115,14 +152,11 @@ static void
 proc_end_waitpid(struct proc *proc) {
   /* remove the process from the table */
   int i;
-  spinlock_acquire(&processTable.lk);
+  rwspinlock_acquire_write(&processTable.lk);
   i = proc->p_pid;
   KASSERT(i>0 && i<=MAX_PROC);
   processTable.proc[i] = NULL;
-  spinlock_release(&processTable.lk);
-
-  cv_destroy(proc->p_cv);
-  lock_destroy(proc->lock);
+  rwspinlock_release_write(&processTable.lk);
 }
 
 /*
@@ -134,13 +168,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = slab_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		slab_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -153,7 +187,7 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-	proc_init_waitpid(proc,name);
+	proc_init_waitpid(proc);
 
 	proc->ended=0;
 	return proc;
@@ -245,7 +279,7 @@ proc_destroy(struct proc *proc)
 	proc_end_waitpid(proc);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	slab_free(proc_cache, proc);
 }
 
 /*
@@ -254,11 +288,16 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = slab_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Could not create the proc cache\n");
+	}
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
 	}
-	spinlock_init(&processTable.lk);
+	rwspinlock_init(&processTable.lk);
 	/* kernel process is not registered in the table */
 	processTable.active = 1;
 }
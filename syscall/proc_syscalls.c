@@ -18,6 +18,7 @@
 #include <mips/trapframe.h>
 #include <current.h>
 #include <synch.h>
+#include <slab.h>
 #include "swapfile.h"
 #include "opt-final.h"
 
@@ -80,11 +81,26 @@ sys_getpid(void)
 }
 
 #if OPT_FORK
+/* the child's copy of the trapframe comes from a slab cache */
+static struct slab_cache *tf_cache;
+
+void
+sys_fork_bootstrap(void) {
+  tf_cache = slab_cache_create("trapframe", sizeof(struct trapframe),
+                               NULL, NULL);
+  if (tf_cache == NULL) {
+    panic("sys_fork_bootstrap: cannot create the trapframe cache\n");
+  }
+}
+
 static void
 call_enter_forked_process(void *tfv, unsigned long dummy) {
-  struct trapframe *tf = (struct trapframe *)tfv;
+  /* copy the trapframe on the stack, as enter_forked_process does
+     not return and would never give it back */
+  struct trapframe tf = *(struct trapframe *)tfv;
   (void)dummy;
-  enter_forked_process(tf); 
+  slab_free(tf_cache, tfv);
+  enter_forked_process(&tf); 
  
   panic("enter_forked_process returned (should not happen)\n");
 }
@@ -135,7 +151,7 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
   #endif
 
   /* we need a copy of the parent's trapframe */
-  tf_child = kmalloc(sizeof(struct trapframe));
+  tf_child = slab_alloc(tf_cache);
   if(tf_child == NULL){
     proc_destroy(newp);
     return ENOMEM; 
@@ -152,7 +168,7 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
   if (result){
     proc_destroy(newp);
-    kfree(tf_child);
+    slab_free(tf_cache, tf_child);
     return ENOMEM;
   }
 
@@ -36,6 +36,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <clock.h>
 #include <test.h>
 
 #include "opt-dumbvm.h"
@@ -378,3 +379,105 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Multithreaded kmalloc throughput benchmark. Each thread repeatedly
+ * allocates a batch of small blocks of rotating sizes and frees them
+ * again, which is the pattern the per-cpu magazines are meant to serve
+ * without the heap lock. The optional argument is the number of
+ * threads. Reports allocations (each with its free) per second.
+ */
+
+#define KM5_ROUNDS	2000
+#define KM5_BATCH	16
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+#define NUM_KM5_SIZES 6
+	static const unsigned sizes[NUM_KM5_SIZES] = {
+		16, 24, 48, 100, 200, 500
+	};
+
+	struct semaphore *sem = sm;
+	void *ptrs[KM5_BATCH];
+	unsigned i, j;
+
+	for (i=0; i<KM5_ROUNDS; i++) {
+		for (j=0; j<KM5_BATCH; j++) {
+			ptrs[j] = kmalloc(sizes[(i + j) % NUM_KM5_SIZES]);
+			if (ptrs[j] == NULL) {
+				panic("kmalloctest5: thread %lu: "
+				      "kmalloc returned NULL\n", num);
+			}
+		}
+		for (j=0; j<KM5_BATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+
+	V(sem);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec start, end, diff;
+	unsigned nthreads;
+	unsigned i;
+	uint64_t ops, nsecs;
+	int result;
+
+	nthreads = NTHREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads == 0) {
+		kprintf("Usage: km5 [threads]\n");
+		return EINVAL;
+	}
+
+	kprintf("Starting kmalloc throughput test with %u threads...\n",
+		nthreads);
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	gettime(&start);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+
+	gettime(&end);
+	timespec_sub(&end, &start, &diff);
+
+	sem_destroy(sem);
+
+	ops = (uint64_t)nthreads * KM5_ROUNDS * KM5_BATCH;
+	nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	kprintf("kmalloctest5: %llu allocations in %llu.%03u s "
+		"(%llu per second, %llu ns each)\n",
+		ops, (unsigned long long)diff.tv_sec,
+		(unsigned)(diff.tv_nsec / 1000000),
+		nsecs ? ops * 1000000000 / nsecs : 0,
+		ops ? nsecs / ops : 0);
+	kprintf("kmalloc throughput test done\n");
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock benchmark.
+ *
+ * For 1 to N threads, each thread acquires and releases the same
+ * spinlock as fast as it can for SLT_SECONDS, with a tiny critical
+ * section, and counts how many times it got the lock. This is done
+ * first with an ordinary (test-and-test-and-set) spinlock and then
+ * with a fair (ticket) spinlock.
+ *
+ * Throughput is the total number of acquisitions per second. Fairness
+ * is the fewest acquisitions made by any thread as a percentage of
+ * the most: 100% means every thread got the lock equally often.
+ *
+ * Run it with as many cpus as threads, so each thread gets a cpu of
+ * its own (the load balancer spreads them out); with fewer cpus the
+ * threads mostly take turns and the lock is rarely contended.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <clock.h>
+#include <test.h>
+
+#define SLT_MAXTHREADS	32
+#define SLT_THREADS	4	/* default N */
+#define SLT_SECONDS	2
+
+static struct spinlock slt_lock;
+static volatile bool slt_go;
+static volatile bool slt_stop;
+static volatile unsigned slt_shared;
+static volatile unsigned slt_counts[SLT_MAXTHREADS];
+
+static
+void
+slt_thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned count = 0;
+
+	while (!slt_go) {
+		/* wait for the others */
+	}
+	while (!slt_stop) {
+		spinlock_acquire(&slt_lock);
+		slt_shared++;
+		spinlock_release(&slt_lock);
+		count++;
+	}
+	slt_counts[num] = count;
+
+	V(sem);
+}
+
+/*
+ * Run one round with NTHREADS threads, and print the results.
+ */
+static
+void
+slt_round(struct semaphore *sem, bool fair, unsigned nthreads)
+{
+	struct timespec start, end, diff;
+	uint64_t total, nsecs;
+	unsigned i, min, max;
+	int result;
+
+	if (fair) {
+		spinlock_init_fair(&slt_lock);
+	}
+	else {
+		spinlock_init(&slt_lock);
+	}
+	slt_go = false;
+	slt_stop = false;
+	slt_shared = 0;
+
+	for (i=0; i<nthreads; i++) {
+		slt_counts[i] = 0;
+		result = thread_fork("spinlocktest", NULL,
+				     slt_thread, sem, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&start);
+	slt_go = true;
+	clocksleep(SLT_SECONDS);
+	slt_stop = true;
+	gettime(&end);
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	timespec_sub(&end, &start, &diff);
+	spinlock_cleanup(&slt_lock);
+
+	total = 0;
+	min = max = slt_counts[0];
+	for (i=0; i<nthreads; i++) {
+		total += slt_counts[i];
+		if (slt_counts[i] < min) {
+			min = slt_counts[i];
+		}
+		if (slt_counts[i] > max) {
+			max = slt_counts[i];
+		}
+	}
+	if (total != slt_shared) {
+		panic("spinlocktest: %llu acquisitions but counter is %u\n",
+		      total, slt_shared);
+	}
+
+	nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	kprintf("%s, %u threads: %llu per second, "
+		"fewest/most %u/%u (%u%%)\n",
+		fair ? "fair" : "ordinary", nthreads,
+		nsecs ? total * 1000000000 / nsecs : 0,
+		min, max, max ? (unsigned)(min * 100ULL / max) : 100);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned nthreads, i;
+
+	nthreads = SLT_THREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads == 0 || nthreads > SLT_MAXTHREADS) {
+		kprintf("Usage: slt [threads (1-%u)]\n", SLT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	kprintf("Starting spinlock test with 1 to %u threads...\n",
+		nthreads);
+
+	sem = sem_create("spinlocktest", 0);
+	if (sem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+
+	for (i=1; i<=nthreads; i++) {
+		slt_round(sem, false, i);
+		slt_round(sem, true, i);
+	}
+
+	sem_destroy(sem);
+	kprintf("Spinlock test done\n");
+	return 0;
+}
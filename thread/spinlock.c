@@ -43,6 +43,11 @@
  * Spinlocks.
  */
 
+/*
+ * Longest a waiter for a fair lock backs off between looks at the
+ * lock, in loop iterations. The wait starts at 1 and doubles.
+ */
+#define SPINLOCK_BACKOFF_MAX	256
 
 /*
  * Initialize spinlock.
@@ -51,10 +56,22 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	splk->splk_fair = false;
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
+/*
+ * Initialize fair spinlock.
+ */
+void
+spinlock_init_fair(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_fair = true;
+}
+
 /*
  * Clean up spinlock.
  */
@@ -62,7 +79,76 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	if (splk->splk_fair) {
+		KASSERT(spinlock_data_get(&splk->splk_lock) ==
+			spinlock_data_get(&splk->splk_next));
+	}
+	else {
+		KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	}
+}
+
+/*
+ * Wait for our turn at a fair lock.
+ *
+ * Take the next ticket; the lock is ours when the number being served
+ * (splk_lock) reaches it. Only the holder changes that number, so
+ * there's nothing to gain from looking at it often while others are
+ * still ahead of us: back off, waiting twice as long each time, and
+ * watch it closely only once we're next.
+ */
+static
+void
+spinlock_wait_fair(struct spinlock *splk)
+{
+	spinlock_data_t ticket, ahead;
+	unsigned backoff;
+	volatile unsigned i;
+
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	backoff = 1;
+	while (1) {
+		ahead = ticket - spinlock_data_get(&splk->splk_lock);
+		if (ahead == 0) {
+			break;
+		}
+		if (ahead > 1) {
+			for (i=0; i<backoff; i++) {
+				/* nothing */
+			}
+			if (backoff < SPINLOCK_BACKOFF_MAX) {
+				backoff *= 2;
+			}
+		}
+	}
+}
+
+/*
+ * Wait for an ordinary lock and take it.
+ */
+static
+void
+spinlock_wait(struct spinlock *splk)
+{
+	while (1) {
+		/*
+		 * Do test-test-and-set, that is, read first before
+		 * doing test-and-set, to reduce bus contention.
+		 *
+		 * Test-and-set is a machine-level atomic operation
+		 * that writes 1 into the lock word and returns the
+		 * previous value. If that value was 0, the lock was
+		 * previously unheld and we now own it. If it was 1,
+		 * we don't.
+		 */
+		if (spinlock_data_get(&splk->splk_lock) != 0) {
+			continue;
+		}
+		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			continue;
+		}
+		break;
+	}
 }
 
 /*
@@ -93,24 +179,11 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	if (splk->splk_fair) {
+		spinlock_wait_fair(splk);
+	}
+	else {
+		spinlock_wait(splk);
 	}
 
 	membar_store_any();
@@ -121,6 +194,49 @@ spinlock_acquire(struct spinlock *splk)
 	}
 }
 
+/*
+ * Get the lock only if nobody holds it. Since this never waits, it
+ * can be used to take a second lock of the same kind without risking
+ * deadlock.
+ */
+bool
+spinlock_tryacquire(struct spinlock *splk)
+{
+	struct cpu *mycpu;
+	bool got;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	mycpu = CURCPU_EXISTS() ? curcpu->c_self : NULL;
+	if (mycpu != NULL && splk->splk_holder == mycpu) {
+		panic("Deadlock on spinlock %p\n", splk);
+	}
+
+	if (splk->splk_fair) {
+		/* Take a ticket only if it would be served at once. */
+		got = spinlock_data_incif(&splk->splk_next,
+				spinlock_data_get(&splk->splk_lock));
+	}
+	else {
+		got = spinlock_data_get(&splk->splk_lock) == 0 &&
+			spinlock_data_testandset(&splk->splk_lock) == 0;
+	}
+	if (!got) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+
+	membar_store_any();
+	splk->splk_holder = mycpu;
+
+	if (mycpu != NULL) {
+		mycpu->c_spinlocks++;
+		HANGMAN_WAIT(&curcpu->c_hangman, &splk->splk_hangman);
+		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
+	}
+	return true;
+}
+
 /*
  * Release the lock.
  */
@@ -137,7 +253,14 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_fair) {
+		/* Serve the next ticket. Only the holder writes this. */
+		spinlock_data_set(&splk->splk_lock,
+				  spinlock_data_get(&splk->splk_lock) + 1);
+	}
+	else {
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -34,7 +34,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
@@ -138,8 +142,72 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times an adaptive lock polls its holder before giving up
+ * and sleeping.
+ */
+#define LOCK_SPIN_MAX		1000
+
+/*
+ * Contention statistics, one entry per lock name, shared by all locks
+ * of that name. Names that don't fit in the table aren't counted.
+ *
+ * The counters are updated only on the contended path, and, when
+ * timing is on, on every acquire and release; the uncontended path
+ * otherwise never touches them.
+ */
+#define LOCKSTAT_MAX		48
+#define LOCKSTAT_NAMELEN	23
+
+struct lockstat {
+	char ls_name[LOCKSTAT_NAMELEN+1];
+	uint32_t ls_acquires;		/* while timing */
+	uint32_t ls_contended;		/* acquires that found it held */
+	uint32_t ls_spins;		/* times a waiter spun */
+	uint32_t ls_spinwins;		/* ...and got it without sleeping */
+	uint32_t ls_sleeps;		/* times a waiter slept */
+	uint64_t ls_holdns;		/* total time held, while timing */
+	uint64_t ls_maxholdns;		/* longest hold */
+};
+
+static struct lockstat lockstats[LOCKSTAT_MAX];
+static unsigned lockstats_num;
+static struct spinlock lockstats_lock = SPINLOCK_INITIALIZER;
+static bool lockstats_timing;
+
+/*
+ * Find or make the entry for NAME.
+ */
+static
+struct lockstat *
+lockstat_get(const char *name)
+{
+	struct lockstat *ls;
+	char shortname[LOCKSTAT_NAMELEN+1];
+	unsigned i;
+
+	snprintf(shortname, sizeof(shortname), "%s", name);
+
+	spinlock_acquire(&lockstats_lock);
+	for (i=0; i<lockstats_num; i++) {
+		if (!strcmp(lockstats[i].ls_name, shortname)) {
+			spinlock_release(&lockstats_lock);
+			return &lockstats[i];
+		}
+	}
+	if (lockstats_num == LOCKSTAT_MAX) {
+		spinlock_release(&lockstats_lock);
+		return NULL;
+	}
+	ls = &lockstats[lockstats_num++];
+	strcpy(ls->ls_name, shortname);
+	spinlock_release(&lockstats_lock);
+	return ls;
+}
+
+static
 struct lock *
-lock_create(const char *name)
+lock_create_common(const char *name, bool adaptive)
 {
         struct lock *lock;
 
@@ -163,9 +231,25 @@ lock_create(const char *name)
 	}
 	lock->lk_owner = NULL;
 	spinlock_init(&lock->lk_lock);
+	lock->lk_adaptive = adaptive;
+	lock->lk_stats = lockstat_get(name);
+	lock->lk_acquiretime.tv_sec = 0;
+	lock->lk_acquiretime.tv_nsec = 0;
     return lock;
 }
 
+struct lock *
+lock_create(const char *name)
+{
+	return lock_create_common(name, false);
+}
+
+struct lock *
+lock_create_adaptive(const char *name)
+{
+	return lock_create_common(name, true);
+}
+
 void
 lock_destroy(struct lock *lock)
 {
@@ -178,9 +262,46 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Whether OWNER, which holds a lock we want, is running on another
+ * cpu, and so may well release it soon.
+ *
+ * OWNER is read without any of its locks held, and may even have
+ * exited by now; at worst the answer is wrong and we spin or sleep
+ * when we shouldn't have.
+ */
+static
+bool
+lock_owner_running(volatile struct thread *owner)
+{
+	return owner != NULL && owner->t_state == S_RUN &&
+		owner->t_cpu != curcpu->c_self;
+}
+
+/*
+ * Spin until LOCK is released, its holder stops running, or we've
+ * spun long enough. Called without lk_lock.
+ */
+static
+void
+lock_spin(struct lock *lock)
+{
+	unsigned i;
+
+	for (i=0; i<LOCK_SPIN_MAX; i++) {
+		if (!lock_owner_running(lock->lk_owner)) {
+			return;
+		}
+	}
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct lockstat *ls;
+	unsigned spins = 0, sleeps = 0;
+	bool spun = false;
+
         // Write this
 	KASSERT(lock != NULL);
 	if (lock_do_i_hold(lock)) {
@@ -191,19 +312,79 @@ lock_acquire(struct lock *lock)
     KASSERT(curthread->t_in_interrupt == false);
 	spinlock_acquire(&lock->lk_lock);        
 	while (lock->lk_owner != NULL) {
+		/*
+		 * Spin (once per wakeup) if the holder is running, as
+		 * it probably won't be long. Otherwise sleep.
+		 */
+		if (lock->lk_adaptive && !spun &&
+		    lock_owner_running(lock->lk_owner)) {
+			spun = true;
+			spins++;
+			spinlock_release(&lock->lk_lock);
+			lock_spin(lock);
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+		spun = false;
+		sleeps++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
-    }
+	}
 	KASSERT(lock->lk_owner == NULL);
 	lock->lk_owner=curthread;
 	spinlock_release(&lock->lk_lock);
+
+	ls = lock->lk_stats;
+	if (ls == NULL || (!lockstats_timing && spins == 0 && sleeps == 0)) {
+		return;
+	}
+	spinlock_acquire(&lockstats_lock);
+	if (spins > 0 || sleeps > 0) {
+		ls->ls_contended++;
+		ls->ls_spins += spins;
+		ls->ls_sleeps += sleeps;
+		if (sleeps == 0) {
+			ls->ls_spinwins++;
+		}
+	}
+	if (lockstats_timing) {
+		ls->ls_acquires++;
+	}
+	spinlock_release(&lockstats_lock);
+	if (lockstats_timing) {
+		/* We hold the lock, so this is ours to set. */
+		gettime(&lock->lk_acquiretime);
+	}
 }
 
 void
 lock_release(struct lock *lock)
 {
+	struct lockstat *ls;
+	struct timespec now;
+	uint64_t holdns;
+
     // Write this
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));
+
+	ls = lock->lk_stats;
+	if (lock->lk_acquiretime.tv_sec != 0 ||
+	    lock->lk_acquiretime.tv_nsec != 0) {
+		gettime(&now);
+		timespec_sub(&now, &lock->lk_acquiretime, &now);
+		holdns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+		lock->lk_acquiretime.tv_sec = 0;
+		lock->lk_acquiretime.tv_nsec = 0;
+		if (ls != NULL && lockstats_timing) {
+			spinlock_acquire(&lockstats_lock);
+			ls->ls_holdns += holdns;
+			if (holdns > ls->ls_maxholdns) {
+				ls->ls_maxholdns = holdns;
+			}
+			spinlock_release(&lockstats_lock);
+		}
+	}
+
 	spinlock_acquire(&lock->lk_lock);
         lock->lk_owner=NULL;
 	/*  G.Cabodi - 2019: no problem here owning a spinlock, as V/wchan_wakeone 
@@ -212,6 +393,52 @@ lock_release(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * Turn timing of lock acquisitions and hold times on or off. Only
+ * once the clock is up: not before the menu runs.
+ */
+void
+lock_settiming(bool on)
+{
+	lockstats_timing = on;
+}
+
+/*
+ * Print the lock statistics, by name, for names that have seen any
+ * contention or (while timing) use.
+ */
+void
+lock_printstats(void)
+{
+	struct lockstat ls;
+	unsigned i, num;
+
+	spinlock_acquire(&lockstats_lock);
+	num = lockstats_num;
+	spinlock_release(&lockstats_lock);
+
+	kprintf("locks: timing %s\n", lockstats_timing ? "on" : "off");
+	for (i=0; i<num; i++) {
+		/* Copy it: kprintf takes a lock. */
+		spinlock_acquire(&lockstats_lock);
+		ls = lockstats[i];
+		spinlock_release(&lockstats_lock);
+
+		if (ls.ls_contended == 0 && ls.ls_acquires == 0) {
+			continue;
+		}
+		kprintf("lock %s: %u contended, %u spins (%u won), "
+			"%u sleeps\n", ls.ls_name, ls.ls_contended,
+			ls.ls_spins, ls.ls_spinwins, ls.ls_sleeps);
+		if (ls.ls_acquires > 0) {
+			kprintf("lock %s: %u acquires, avg hold %u us, "
+				"max %u us\n", ls.ls_name, ls.ls_acquires,
+				(unsigned)(ls.ls_holdns / ls.ls_acquires / 1000),
+				(unsigned)(ls.ls_maxholdns / 1000));
+		}
+	}
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
@@ -325,4 +552,326 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	spinlock_acquire(&cv->cv_lock);
 	wchan_wakeall(cv->cv_wchan,&cv->cv_lock);
 	spinlock_release(&cv->cv_lock);
-}
\ No newline at end of file
+}
+////////////////////////////////////////////////////////////
+//
+// Reader-writer locks.
+
+/*
+ * The state word: the number of readers holding the lock, the number
+ * of writers waiting for it, and whether a writer holds it. It is only
+ * ever changed with compare-and-swap, so taking and dropping a read
+ * hold is one atomic update, with no lock around it.
+ */
+#define RW_READERS	0x0000ffff	/* readers holding the lock */
+#define RW_WAITER	0x00010000	/* one waiting writer */
+#define RW_WAITERS	0x7fff0000	/* writers waiting */
+#define RW_WRITER	0x80000000	/* a writer holds the lock */
+
+/*
+ * Add a reader, unless a writer holds the lock or is waiting for it.
+ * Returns false, without waiting, if so.
+ */
+static
+bool
+rw_state_read(volatile spinlock_data_t *state)
+{
+	spinlock_data_t w;
+
+	while (1) {
+		w = spinlock_data_get(state);
+		if (w & (RW_WRITER | RW_WAITERS)) {
+			return false;
+		}
+		KASSERT((w & RW_READERS) != RW_READERS);
+		if (spinlock_data_cas(state, w, w + 1)) {
+			return true;
+		}
+	}
+}
+
+/*
+ * Remove a reader. Returns the new state.
+ */
+static
+spinlock_data_t
+rw_state_unread(volatile spinlock_data_t *state)
+{
+	spinlock_data_t w;
+
+	while (1) {
+		w = spinlock_data_get(state);
+		KASSERT((w & RW_READERS) != 0);
+		if (spinlock_data_cas(state, w, w - 1)) {
+			return w - 1;
+		}
+	}
+}
+
+/*
+ * Register a waiting writer, which keeps new readers out.
+ */
+static
+void
+rw_state_addwaiter(volatile spinlock_data_t *state)
+{
+	spinlock_data_t w;
+
+	while (1) {
+		w = spinlock_data_get(state);
+		KASSERT((w & RW_WAITERS) != RW_WAITERS);
+		if (spinlock_data_cas(state, w, w + RW_WAITER)) {
+			return;
+		}
+	}
+}
+
+/*
+ * Turn a waiting writer into the holder, if no one holds the lock.
+ * Returns false, without waiting, if someone does.
+ */
+static
+bool
+rw_state_write(volatile spinlock_data_t *state)
+{
+	spinlock_data_t w;
+
+	while (1) {
+		w = spinlock_data_get(state);
+		if (w & (RW_WRITER | RW_READERS)) {
+			return false;
+		}
+		KASSERT((w & RW_WAITERS) != 0);
+		if (spinlock_data_cas(state, w, w - RW_WAITER + RW_WRITER)) {
+			return true;
+		}
+	}
+}
+
+/*
+ * Remove the writer. Returns the new state.
+ */
+static
+spinlock_data_t
+rw_state_unwrite(volatile spinlock_data_t *state)
+{
+	spinlock_data_t w;
+
+	while (1) {
+		w = spinlock_data_get(state);
+		KASSERT(w & RW_WRITER);
+		if (spinlock_data_cas(state, w, w - RW_WRITER)) {
+			return w - RW_WRITER;
+		}
+	}
+}
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_data_set(&rw->rw_state, 0);
+	spinlock_init(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(spinlock_data_get(&rw->rw_state) == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Sleepers check the state with rw_lock held and sleep without
+ * dropping it, and whoever changes the state so that they could go
+ * on takes rw_lock after the change to wake them up, so no wakeup
+ * can be missed.
+ */
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	if (!rw_state_read(&rw->rw_state)) {
+		spinlock_acquire(&rw->rw_lock);
+		while (!rw_state_read(&rw->rw_state)) {
+			wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+		}
+		spinlock_release(&rw->rw_lock);
+	}
+	membar_store_any();
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	spinlock_data_t w;
+
+	KASSERT(rw != NULL);
+
+	membar_any_store();
+	w = rw_state_unread(&rw->rw_state);
+	if ((w & RW_READERS) == 0 && (w & RW_WAITERS) != 0) {
+		/* Last reader out, and a writer is waiting. */
+		spinlock_acquire(&rw->rw_lock);
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+		spinlock_release(&rw->rw_lock);
+	}
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	rw_state_addwaiter(&rw->rw_state);
+	if (!rw_state_write(&rw->rw_state)) {
+		spinlock_acquire(&rw->rw_lock);
+		while (!rw_state_write(&rw->rw_state)) {
+			wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+		}
+		spinlock_release(&rw->rw_lock);
+	}
+	membar_store_any();
+	rw->rw_writer = curthread;
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	spinlock_data_t w;
+
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == curthread);
+
+	rw->rw_writer = NULL;
+	membar_any_store();
+	w = rw_state_unwrite(&rw->rw_state);
+
+	/* Writers first; the readers go when none are left waiting. */
+	spinlock_acquire(&rw->rw_lock);
+	if (w & RW_WAITERS) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	return rw->rw_writer == curthread;
+}
+
+/*
+ * The spinning kind. Like a spinlock, it is held by the CPU with
+ * interrupts off, and must not be held across sleeping; unlike one,
+ * it doesn't know who holds it, so taking it again on the same CPU
+ * for writing hangs instead of panicking.
+ */
+void
+rwspinlock_init(struct rwspinlock *rws)
+{
+	spinlock_data_set(&rws->rws_state, 0);
+}
+
+void
+rwspinlock_cleanup(struct rwspinlock *rws)
+{
+	KASSERT(spinlock_data_get(&rws->rws_state) == 0);
+}
+
+void
+rwspinlock_acquire_read(struct rwspinlock *rws)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	if (CURCPU_EXISTS()) {
+		curcpu->c_spinlocks++;
+	}
+
+	while (!rw_state_read(&rws->rws_state)) {
+		/* spin */
+	}
+	membar_store_any();
+}
+
+void
+rwspinlock_release_read(struct rwspinlock *rws)
+{
+	membar_any_store();
+	rw_state_unread(&rws->rws_state);
+
+	if (CURCPU_EXISTS()) {
+		KASSERT(curcpu->c_spinlocks > 0);
+		curcpu->c_spinlocks--;
+	}
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+void
+rwspinlock_acquire_write(struct rwspinlock *rws)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	if (CURCPU_EXISTS()) {
+		curcpu->c_spinlocks++;
+	}
+
+	rw_state_addwaiter(&rws->rws_state);
+	while (!rw_state_write(&rws->rws_state)) {
+		/* spin */
+	}
+	membar_store_any();
+}
+
+void
+rwspinlock_release_write(struct rwspinlock *rws)
+{
+	membar_any_store();
+	rw_state_unwrite(&rws->rws_state);
+
+	if (CURCPU_EXISTS()) {
+		KASSERT(curcpu->c_spinlocks > 0);
+		curcpu->c_spinlocks--;
+	}
+	spllower(IPL_HIGH, IPL_NONE);
+}
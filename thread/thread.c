@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -48,6 +49,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include "opt-final.h"
@@ -59,6 +61,52 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Pool of destroyed threads, kept with their stacks for thread_create
+ * to reuse, so that each fork doesn't have to allocate a new stack
+ * (which may mean evicting user pages). At most thread_pool_max
+ * threads are kept, and the VM can take them back when it runs out of
+ * memory (thread_pool_reclaim).
+ */
+#define THREAD_POOL_MAX 16
+
+static struct threadlist thread_pool;
+static struct spinlock thread_pool_lock = SPINLOCK_INITIALIZER;
+static unsigned thread_pool_max = THREAD_POOL_MAX;
+
+/*
+ * Scheduler tuning.
+ *
+ * A thread runs for SCHED_QUANTUM(level) clock ticks at a time; if it
+ * uses all of them it is moved down a level, and each time it wakes up
+ * from sleeping it is moved up one. Every SCHED_BOOST_HARDCLOCKS all
+ * the threads of a cpu are put back at level 0, so that nothing
+ * starves.
+ */
+#define SCHED_QUANTUM(level)	((level) + 1)
+#define SCHED_BOOST_HARDCLOCKS	256
+
+/*
+ * Load balancing. A cpu that runs out of work, or finds itself much
+ * less loaded than another when thread_consider_migration runs, takes
+ * half the difference from the busiest cpu. It gives up after
+ * SCHED_STEAL_TRIES attempts at that cpu's runqueue lock, and leaves
+ * alone threads that ran there within the last
+ * SCHED_AFFINITY_HARDCLOCKS, whose cache is still warm.
+ */
+#define SCHED_STEAL_TRIES		4
+#define SCHED_AFFINITY_HARDCLOCKS	2
+
+static bool sched_mlfq = true;		/* false: plain round-robin */
+static bool sched_timing;		/* clock usable for latency stats */
+
+/* Statistics */
+static uint32_t thread_pool_hits;	/* threads reused from the pool */
+static uint32_t thread_pool_misses;	/* threads allocated afresh */
+static uint32_t thread_pool_puts;	/* threads put back in the pool */
+static uint32_t thread_pool_drops;	/* threads freed, pool full */
+static uint32_t thread_pool_reclaimed;	/* threads freed for the VM */
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -112,9 +160,37 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Give the storage of a thread back: to the pool, if it has a stack
+ * and the pool isn't full, or else to kfree.
+ */
+static
+void
+thread_release(struct thread *thread)
+{
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_pool_lock);
+		if (thread_pool.tl_count < thread_pool_max) {
+			threadlistnode_init(&thread->t_listnode, thread);
+			threadlist_addhead(&thread_pool, thread);
+			thread_pool_puts++;
+			spinlock_release(&thread_pool_lock);
+			return;
+		}
+		thread_pool_drops++;
+		spinlock_release(&thread_pool_lock);
+
+		kfree(thread->t_stack);
+	}
+	kfree(thread);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The thread may come from the pool, in which case it already has a
+ * stack; otherwise t_stack is NULL.
  */
 static
 struct thread *
@@ -124,14 +200,27 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	spinlock_acquire(&thread_pool_lock);
+	thread = threadlist_remhead(&thread_pool);
+	if (thread != NULL) {
+		thread_pool_hits++;
+	}
+	else {
+		thread_pool_misses++;
+	}
+	spinlock_release(&thread_pool_lock);
+
 	if (thread == NULL) {
-		return NULL;
+		thread = kmalloc(sizeof(*thread));
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		thread_release(thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -140,12 +229,18 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* Scheduling fields: new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_readytime.tv_sec = 0;
+	thread->t_readytime.tv_nsec = 0;
+	thread->t_lastrun = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -170,6 +265,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -185,8 +281,21 @@ cpu_create(unsigned hardware_number)
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+		c->c_rq_dispatches[i] = 0;
+		c->c_rq_waitns[i] = 0;
+	}
+	c->c_runqueue_bits = 0;
+	c->c_runqueue_count = 0;
+	spinlock_init_fair(&c->c_runqueue_lock);
+	c->c_rq_maxwaitns = 0;
+	c->c_rq_boosts = 0;
+	c->c_steals = 0;
+	c->c_stolen_in = 0;
+	c->c_stolen_out = 0;
+	c->c_steal_busy = 0;
+	c->c_idlens = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -214,9 +323,11 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+			if (c->c_curthread->t_stack == NULL) {
+				panic("cpu_create: couldn't allocate stack");
+			}
 		}
 		thread_checkstack_init(c->c_curthread);
 	}
@@ -279,7 +390,8 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		/* Don't recycle a stack that has overflowed. */
+		thread_checkstack(thread);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -288,7 +400,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread_release(thread);
 }
 
 /*
@@ -310,6 +422,78 @@ exorcise(void)
 	}
 }
 
+/*
+ * Set the number of threads kept in the pool, freeing any beyond it.
+ */
+void
+thread_pool_setmax(unsigned max)
+{
+	struct thread *t;
+
+	spinlock_acquire(&thread_pool_lock);
+	thread_pool_max = max;
+	while (thread_pool.tl_count > thread_pool_max) {
+		t = threadlist_remhead(&thread_pool);
+		spinlock_release(&thread_pool_lock);
+
+		kfree(t->t_stack);
+		kfree(t);
+
+		spinlock_acquire(&thread_pool_lock);
+	}
+	spinlock_release(&thread_pool_lock);
+}
+
+/*
+ * Reclaim function for the VM: free pooled threads, and with them
+ * their stacks. Never sleeps.
+ */
+static
+int
+thread_pool_reclaim(unsigned npages)
+{
+	struct thread *t;
+	unsigned freed = 0;
+
+	spinlock_acquire(&thread_pool_lock);
+	while (freed < npages &&
+	       (t = threadlist_remhead(&thread_pool)) != NULL) {
+		thread_pool_reclaimed++;
+		spinlock_release(&thread_pool_lock);
+
+		kfree(t->t_stack);
+		kfree(t);
+		freed += DIVROUNDUP(STACK_SIZE, PAGE_SIZE);
+
+		spinlock_acquire(&thread_pool_lock);
+	}
+	spinlock_release(&thread_pool_lock);
+
+	return freed;
+}
+
+/*
+ * Print the thread pool statistics.
+ */
+void
+thread_pool_printstats(void)
+{
+	uint32_t hits, misses;
+
+	spinlock_acquire(&thread_pool_lock);
+	hits = thread_pool_hits;
+	misses = thread_pool_misses;
+	kprintf("thread pool: %u/%u threads kept\n",
+		thread_pool.tl_count, thread_pool_max);
+	kprintf("thread pool: %u creates, %u from the pool (%u%%)\n",
+		hits + misses, hits,
+		hits + misses ? (unsigned)(hits * 100ULL / (hits + misses)) : 0);
+	kprintf("thread pool: %u threads put back, %u freed (pool full), "
+		"%u reclaimed by the VM\n",
+		thread_pool_puts, thread_pool_drops, thread_pool_reclaimed);
+	spinlock_release(&thread_pool_lock);
+}
+
 /*
  * On panic, stop the thread system (as much as is reasonably
  * possible) to make sure we don't end up letting any other threads
@@ -318,6 +502,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -332,9 +519,14 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runqueue_bits = 0;
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -376,6 +568,8 @@ void
 thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
+	threadlist_init(&thread_pool);
+	vm_register_reclaim(thread_pool_reclaim);
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -444,6 +638,255 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	/* The clock has been probed; start timing the run queues. */
+	sched_timing = true;
+}
+
+/*
+ * Run queues.
+ *
+ * Each cpu has a run queue per priority level, and a bitmap of the
+ * levels that have threads, so the next thread to run is found in
+ * constant time. All of these are called with the cpu's runqueue
+ * lock held.
+ */
+
+/* Lowest set bit of each 4-bit value (4 if none). */
+static const uint8_t runqueue_lowbit[16] = {
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+};
+
+/*
+ * Highest priority (lowest numbered) level that has threads, or
+ * RUNQUEUE_LEVELS if none.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	uint32_t bits = c->c_runqueue_bits;
+
+	COMPILE_ASSERT(RUNQUEUE_LEVELS <= 8);
+	if (bits == 0) {
+		return RUNQUEUE_LEVELS;
+	}
+	if (bits & 0xf) {
+		return runqueue_lowbit[bits & 0xf];
+	}
+	return 4 + runqueue_lowbit[bits >> 4];
+}
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < RUNQUEUE_LEVELS);
+
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runqueue_bits |= 1U << t->t_priority;
+	c->c_runqueue_count++;
+}
+
+/*
+ * Remove the first thread of level LEVEL, which must have one.
+ */
+static
+struct thread *
+runqueue_remlevel(struct cpu *c, unsigned level)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t = threadlist_remhead(&c->c_runqueue[level]);
+	KASSERT(t != NULL);
+	if (threadlist_isempty(&c->c_runqueue[level])) {
+		c->c_runqueue_bits &= ~(1U << level);
+	}
+	c->c_runqueue_count--;
+	return t;
+}
+
+/*
+ * Remove the thread that should run next, or return NULL if there is
+ * none. Updates the latency statistics.
+ */
+static
+struct thread *
+runqueue_next(struct cpu *c)
+{
+	struct thread *t;
+	struct timespec now, wait;
+	uint64_t waitns;
+	unsigned level;
+
+	level = runqueue_toplevel(c);
+	if (level == RUNQUEUE_LEVELS) {
+		return NULL;
+	}
+	t = runqueue_remlevel(c, level);
+
+	c->c_rq_dispatches[level]++;
+	if (sched_timing &&
+	    (t->t_readytime.tv_sec != 0 || t->t_readytime.tv_nsec != 0)) {
+		gettime(&now);
+		timespec_sub(&now, &t->t_readytime, &wait);
+		waitns = (uint64_t)wait.tv_sec * 1000000000 + wait.tv_nsec;
+		c->c_rq_waitns[level] += waitns;
+		if (waitns > c->c_rq_maxwaitns) {
+			c->c_rq_maxwaitns = waitns;
+		}
+	}
+	return t;
+}
+
+/*
+ * Remove thread T, which is on one of the run queues of C.
+ */
+static
+void
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_cpu == c);
+
+	threadlist_remove(&c->c_runqueue[t->t_priority], t);
+	if (threadlist_isempty(&c->c_runqueue[t->t_priority])) {
+		c->c_runqueue_bits &= ~(1U << t->t_priority);
+	}
+	c->c_runqueue_count--;
+}
+
+/*
+ * Load of a cpu: the threads waiting plus the one running, if any.
+ * Read without the lock when choosing a victim, so it's only a hint.
+ */
+static
+unsigned
+runqueue_load(struct cpu *c)
+{
+	return c->c_runqueue_count + (c->c_isidle ? 0 : 1);
+}
+
+/*
+ * Whether thread T last ran on cpu C too recently to move it.
+ */
+static
+bool
+runqueue_cachehot(struct cpu *c, struct thread *t)
+{
+	return t->t_lastrun != 0 &&
+		c->c_hardclocks - t->t_lastrun < SCHED_AFFINITY_HARDCLOCKS;
+}
+
+/*
+ * Take threads from the busiest other cpu onto cpu ME, whose runqueue
+ * lock is held, if that evens out the load. Returns the number of
+ * threads taken.
+ *
+ * Holding two runqueue locks at once is safe only because the second
+ * one is never waited for.
+ */
+static
+unsigned
+runqueue_steal(struct cpu *me)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *prev;
+	unsigned i, load, maxload, myload, want, moved, level;
+
+	KASSERT(spinlock_do_i_hold(&me->c_runqueue_lock));
+
+	myload = runqueue_load(me);
+	victim = NULL;
+	maxload = myload + 1;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == me || c->c_runqueue_count == 0) {
+			continue;
+		}
+		load = runqueue_load(c);
+		if (load > maxload) {
+			victim = c;
+			maxload = load;
+		}
+	}
+	if (victim == NULL) {
+		return 0;
+	}
+
+	for (i=0; !spinlock_tryacquire(&victim->c_runqueue_lock); i++) {
+		if (i == SCHED_STEAL_TRIES - 1) {
+			me->c_steal_busy++;
+			return 0;
+		}
+	}
+
+	/* Check again now that it can't change. */
+	load = runqueue_load(victim);
+	want = load > myload + 1 ? (load - myload) / 2 : 0;
+
+	/* Take the lowest priority threads first, oldest last. */
+	moved = 0;
+	for (level = RUNQUEUE_LEVELS; level-- > 0 && moved < want; ) {
+		for (t = victim->c_runqueue[level].tl_tail.tln_prev->tln_self;
+		     t != NULL && moved < want; t = prev) {
+			prev = t->t_listnode.tln_prev->tln_self;
+			/*
+			 * The victim's curthread can be on its run queue
+			 * if it was woken while the cpu was idle and the
+			 * cpu hasn't finished unidling; it must not move.
+			 */
+			if (t == victim->c_curthread ||
+			    runqueue_cachehot(victim, t)) {
+				continue;
+			}
+			runqueue_remove(victim, t);
+			t->t_cpu = me;
+			runqueue_add(me, t);
+			DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+			      t->t_name, victim->c_number, me->c_number);
+			moved++;
+		}
+	}
+	victim->c_stolen_out += moved;
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (moved > 0) {
+		me->c_steals++;
+		me->c_stolen_in += moved;
+	}
+	return moved;
+}
+
+/*
+ * Put every thread of cpu C, including the one running, back at the
+ * top level.
+ */
+static
+void
+runqueue_boost(struct cpu *c)
+{
+	struct thread *t;
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (level = 1; level < RUNQUEUE_LEVELS; level++) {
+		while (!threadlist_isempty(&c->c_runqueue[level])) {
+			t = runqueue_remlevel(c, level);
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			runqueue_add(c, t);
+		}
+	}
+	if (!c->c_isidle) {
+		c->c_curthread->t_priority = 0;
+		c->c_curthread->t_ticks = 0;
+	}
+	c->c_rq_boosts++;
 }
 
 /*
@@ -470,7 +913,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	if (sched_timing) {
+		gettime(&target->t_readytime);
+	}
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -509,11 +955,13 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless it came with one from the pool */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -551,6 +999,27 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Wait for an interrupt, returning how long that took (in ns), if
+ * the clock is up.
+ */
+static
+uint64_t
+thread_idle(void)
+{
+	struct timespec before, after;
+
+	if (!sched_timing) {
+		cpu_idle();
+		return 0;
+	}
+	gettime(&before);
+	cpu_idle();
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	return (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -566,6 +1035,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	uint64_t idlens;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -592,12 +1062,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/*
+	 * A thread that yields lets the best of the others run, even if
+	 * it has a lower priority, so pick that before queueing it.
+	 */
+	next = (newstate == S_READY) ? runqueue_next(curcpu) : NULL;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -624,9 +1100,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastrun = curcpu->c_hardclocks;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to take some
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -644,14 +1122,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
-	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
-			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
-			spinlock_acquire(&curcpu->c_runqueue_lock);
+	while (next == NULL) {
+		next = runqueue_next(curcpu);
+		if (next != NULL || runqueue_steal(curcpu->c_self) > 0) {
+			continue;
 		}
-	} while (next == NULL);
+		spinlock_release(&curcpu->c_runqueue_lock);
+		idlens = thread_idle();
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		curcpu->c_idlens += idlens;
+	}
 	curcpu->c_isidle = false;
 
 	/*
@@ -820,139 +1300,187 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Threads are scheduled with a multi-level feedback queue: the cpu
+ * runs the threads of the highest priority level that has any, in
+ * round-robin order. A thread that uses up its quantum is demoted
+ * (CPU-bound), one that sleeps is promoted when it wakes up (I/O-bound,
+ * e.g. waiting for a page to be swapped in), and schedule()
+ * periodically boosts everything back to the top so that demoted
+ * threads cannot starve.
+ *
+ * With sched_mlfq off, every thread stays at level 0 and is
+ * preempted on every tick, which is plain round-robin.
  */
 
+/*
+ * Called on every clock tick.
+ */
 void
-schedule(void)
+thread_tick(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur = curthread;
+	unsigned top;
+	bool preempt;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* The timer interrupted the idle loop. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	top = runqueue_toplevel(curcpu);
+	if (!sched_mlfq) {
+		preempt = top < RUNQUEUE_LEVELS;
+	}
+	else if (++cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* Used up its quantum: demote it, and let its peers run. */
+		if (cur->t_priority < RUNQUEUE_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = top <= cur->t_priority;
+	}
+	else {
+		/* Only give way to a thread of higher priority. */
+		preempt = top < cur->t_priority;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Promote a thread that is waking up. Called with the wchan lock held.
  */
+static
 void
-thread_consider_migration(void)
+thread_wakeboost(struct thread *t)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	KASSERT(t->t_state == S_SLEEP);
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	if (sched_mlfq && t->t_priority > 0) {
+		t->t_priority--;
 	}
+	t->t_ticks = 0;
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+/*
+ * This is called periodically from hardclock(). It boosts all the
+ * threads of the current CPU back to the top level every
+ * SCHED_BOOST_HARDCLOCKS.
+ */
+void
+schedule(void)
+{
+	if (!sched_mlfq ||
+	    curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS != 0) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	runqueue_boost(curcpu);
 	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Switch between MLFQ and round-robin. Every thread starts over at
+ * the top level.
+ */
+void
+thread_sched_setmlfq(bool mlfq)
+{
+	struct cpu *c;
+	unsigned i;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	sched_mlfq = mlfq;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+		runqueue_boost(c);
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+/*
+ * Print how long runnable threads waited to run, by priority level.
+ * The counts are cumulative; switch policy and compare the averages.
+ */
+void
+thread_sched_printstats(void)
+{
+	struct cpu *c;
+	uint32_t dispatches[RUNQUEUE_LEVELS], boosts, total;
+	uint32_t steals, stolen_in, stolen_out, steal_busy;
+	uint64_t waitns[RUNQUEUE_LEVELS], maxwaitns, totalns, idlens;
+	unsigned i, level;
+
+	kprintf("scheduler: %s\n", sched_mlfq ? "MLFQ" : "round-robin");
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (level=0; level<RUNQUEUE_LEVELS; level++) {
+			dispatches[level] = c->c_rq_dispatches[level];
+			waitns[level] = c->c_rq_waitns[level];
 		}
+		maxwaitns = c->c_rq_maxwaitns;
+		boosts = c->c_rq_boosts;
+		steals = c->c_steals;
+		stolen_in = c->c_stolen_in;
+		stolen_out = c->c_stolen_out;
+		steal_busy = c->c_steal_busy;
+		idlens = c->c_idlens;
 		spinlock_release(&c->c_runqueue_lock);
-	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		total = 0;
+		totalns = 0;
+		for (level=0; level<RUNQUEUE_LEVELS; level++) {
+			total += dispatches[level];
+			totalns += waitns[level];
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		kprintf("cpu%u: %u dispatches, avg wait %u us, max %u us, "
+			"%u boosts\n", c->c_number, total,
+			total ? (unsigned)(totalns / total / 1000) : 0,
+			(unsigned)(maxwaitns / 1000), boosts);
+		for (level=0; level<RUNQUEUE_LEVELS; level++) {
+			if (dispatches[level] == 0) {
+				continue;
+			}
+			kprintf("cpu%u:   level %u: %u dispatches, "
+				"avg wait %u us\n", c->c_number, level,
+				dispatches[level],
+				(unsigned)(waitns[level] / dispatches[level] /
+					   1000));
+		}
+		kprintf("cpu%u: took %u threads in %u steals, gave %u, "
+			"%u steals abandoned, idle %u ms\n", c->c_number,
+			stolen_in, steals, stolen_out, steal_busy,
+			(unsigned)(idlens / 1000000));
 	}
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * Thread migration.
+ *
+ * This is also called periodically from hardclock(). Threads are
+ * pulled, not pushed: if another CPU is busier than this one, take
+ * some of its threads. An idle CPU does the same on its own before
+ * going to sleep (see thread_switch), so this only matters for
+ * evening out CPUs that are both busy.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. So threads that ran very recently are left
+ * where they are (see runqueue_steal); System/161 does not (yet)
+ * model such cache effects, but real hardware does.
+ */
+void
+thread_consider_migration(void)
+{
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_steal(curcpu->c_self);
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1044,6 +1572,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1074,6 +1603,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
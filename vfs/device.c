@@ -373,6 +373,24 @@ dev_create_vnode(struct device *dev)
 	return v;
 }
 
+/*
+ * Return the request queue of the device behind a vnode, for code that
+ * queues block requests directly instead of going through VOP_READ and
+ * VOP_WRITE. Returns NULL if the vnode is not a device or if the device
+ * has no queue.
+ */
+struct disksched *
+dev_getsched(struct vnode *vn)
+{
+	struct device *d;
+
+	if (vn->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	d = vn->vn_data;
+	return d->d_sched;
+}
+
 /*
  * Undo dev_create_vnode.
  *
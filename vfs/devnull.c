@@ -116,6 +116,7 @@ devnull_create(void)
 	dev->d_devnumber = 0; /* assigned by vfs_adddev */
 
 	dev->d_data = NULL;
+	dev->d_sched = NULL;
 
 	result = vfs_adddev("null", dev, 0);
 	if (result) {
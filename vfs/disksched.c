@@ -0,0 +1,401 @@
+/*
+ * Disk request scheduler (C-LOOK).
+ *
+ * Pending requests are kept in a list sorted by block. When the device
+ * becomes idle, the first request at or after the current head position
+ * is dispatched; if there is none, the head sweeps back to the lowest
+ * pending block (C-LOOK). Requests that start where the dispatched one
+ * ends, in the same direction, are chained to it and transferred right
+ * after it, so nothing else can be scheduled in between.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <wchan.h>
+#include <disksched.h>
+
+/* All schedulers, for disksched_printstats. */
+static struct disksched *disksched_list;
+
+/*
+ * Set up a scheduler.
+ */
+int
+disksched_init(struct disksched *ds, const char *name, uint32_t blocksize,
+	       void (*start)(void *drv, struct diskreq *req), void *drv)
+{
+	ds->ds_name = kstrdup(name);
+	if (ds->ds_name == NULL) {
+		return ENOMEM;
+	}
+	ds->ds_wchan = wchan_create(ds->ds_name);
+	if (ds->ds_wchan == NULL) {
+		kfree(ds->ds_name);
+		return ENOMEM;
+	}
+	spinlock_init(&ds->ds_lock);
+
+	ds->ds_start = start;
+	ds->ds_drv = drv;
+	ds->ds_blocksize = blocksize;
+	ds->ds_favorreads = true;
+
+	ds->ds_queue = NULL;
+	ds->ds_active = NULL;
+	ds->ds_headpos = 0;
+	ds->ds_readbatch = 0;
+	ds->ds_depth = 0;
+
+	ds->ds_requests = 0;
+	ds->ds_blocks = 0;
+	ds->ds_dispatches = 0;
+	ds->ds_merged = 0;
+	ds->ds_maxdepth = 0;
+	ds->ds_depthsum = 0;
+	ds->ds_waitns = 0;
+
+	/* Devices are attached before anything else runs; no lock needed. */
+	ds->ds_next = disksched_list;
+	disksched_list = ds;
+
+	return 0;
+}
+
+/*
+ * Insert a request in the queue, after any request for the same block
+ * (so that requests for the same block are served in FIFO order).
+ */
+static
+void
+disksched_insert(struct disksched *ds, struct diskreq *req)
+{
+	struct diskreq **pp;
+
+	for (pp = &ds->ds_queue; *pp != NULL; pp = &(*pp)->dr_link) {
+		if ((*pp)->dr_block > req->dr_block) {
+			break;
+		}
+	}
+	req->dr_link = *pp;
+	*pp = req;
+}
+
+/*
+ * Remove the next request to transfer from the queue, with the
+ * requests chained to it. Returns NULL if the queue is empty.
+ */
+static
+struct diskreq *
+disksched_pick(struct disksched *ds)
+{
+	struct diskreq **pp, **first, **pick;
+	struct diskreq *req, *tail, *r;
+	bool reads, writes, onlyreads;
+	uint32_t end, n;
+
+	KASSERT(spinlock_do_i_hold(&ds->ds_lock));
+
+	if (ds->ds_queue == NULL) {
+		return NULL;
+	}
+
+	reads = writes = false;
+	for (r = ds->ds_queue; r != NULL; r = r->dr_link) {
+		if (r->dr_write) {
+			writes = true;
+		}
+		else {
+			reads = true;
+		}
+	}
+	if (!writes) {
+		ds->ds_readbatch = 0;
+	}
+	onlyreads = ds->ds_favorreads && reads &&
+		ds->ds_readbatch < DISKSCHED_READBATCH;
+
+	/* C-LOOK: first eligible request at or after the head... */
+	first = pick = NULL;
+	for (pp = &ds->ds_queue; *pp != NULL; pp = &(*pp)->dr_link) {
+		if (onlyreads && (*pp)->dr_write) {
+			continue;
+		}
+		if (first == NULL) {
+			first = pp;
+		}
+		if ((*pp)->dr_block >= ds->ds_headpos) {
+			pick = pp;
+			break;
+		}
+	}
+	/* ...or else sweep back to the lowest one. */
+	if (pick == NULL) {
+		pick = first;
+	}
+	KASSERT(pick != NULL);
+
+	req = *pick;
+	*pick = req->dr_link;
+
+	/*
+	 * Chain the requests that continue this one. The queue is sorted,
+	 * so they can only follow it.
+	 */
+	tail = req;
+	end = req->dr_block + req->dr_nblocks;
+	n = req->dr_nblocks;
+	pp = pick;
+	while (*pp != NULL && (*pp)->dr_block <= end) {
+		r = *pp;
+		if (r->dr_block == end && r->dr_write == req->dr_write &&
+		    n + r->dr_nblocks <= DISKSCHED_MAXMERGE) {
+			*pp = r->dr_link;
+			tail->dr_chain = r;
+			tail = r;
+			end += r->dr_nblocks;
+			n += r->dr_nblocks;
+			ds->ds_merged++;
+		}
+		else {
+			pp = &r->dr_link;
+		}
+	}
+	tail->dr_chain = NULL;
+
+	ds->ds_headpos = end;
+	if (req->dr_write) {
+		ds->ds_readbatch = 0;
+	}
+	else if (writes) {
+		ds->ds_readbatch++;
+	}
+	ds->ds_dispatches++;
+
+	return req;
+}
+
+/*
+ * Queue a request without waiting for it.
+ */
+void
+disksched_start(struct disksched *ds, struct diskreq *req)
+{
+	KASSERT(req->dr_nblocks > 0);
+
+	req->dr_done = false;
+	req->dr_result = 0;
+	req->dr_link = NULL;
+	req->dr_chain = NULL;
+	gettime(&req->dr_submitted);
+
+	spinlock_acquire(&ds->ds_lock);
+
+	disksched_insert(ds, req);
+	ds->ds_depth++;
+	ds->ds_depthsum += ds->ds_depth;
+	if (ds->ds_depth > ds->ds_maxdepth) {
+		ds->ds_maxdepth = ds->ds_depth;
+	}
+
+	/* If the device is idle, get it going. */
+	if (ds->ds_active == NULL) {
+		ds->ds_active = disksched_pick(ds);
+		ds->ds_start(ds->ds_drv, ds->ds_active);
+	}
+
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * Wait for a request to complete.
+ */
+int
+disksched_wait(struct disksched *ds, struct diskreq *req)
+{
+	spinlock_acquire(&ds->ds_lock);
+	while (!req->dr_done) {
+		wchan_sleep(ds->ds_wchan, &ds->ds_lock);
+	}
+	spinlock_release(&ds->ds_lock);
+
+	return req->dr_result;
+}
+
+/*
+ * Queue a request and wait for it to complete.
+ */
+int
+disksched_submit(struct disksched *ds, struct diskreq *req)
+{
+	req->dr_callback = NULL;
+	req->dr_cbarg = NULL;
+	disksched_start(ds, req);
+	return disksched_wait(ds, req);
+}
+
+/*
+ * Called by the driver when the active request has completed: run its
+ * callback, wake up whoever is waiting for it and start the next one, which is the next
+ * request of the same chain if there is one.
+ */
+void
+disksched_done(struct disksched *ds, struct diskreq *req, int result)
+{
+	struct diskreq *next;
+	struct timespec now, wait;
+
+	KASSERT(spinlock_do_i_hold(&ds->ds_lock));
+	KASSERT(req == ds->ds_active);
+
+	next = req->dr_chain;
+
+	gettime(&now);
+	timespec_sub(&now, &req->dr_submitted, &wait);
+	ds->ds_waitns += (uint64_t)wait.tv_sec * 1000000000 + wait.tv_nsec;
+	ds->ds_requests++;
+	ds->ds_blocks += req->dr_nblocks;
+	ds->ds_depth--;
+
+	req->dr_result = result;
+	req->dr_done = true;
+	wchan_wakeall(ds->ds_wchan, &ds->ds_lock);
+
+	/* Last use of the request: the callback may free or reuse it. */
+	if (req->dr_callback != NULL) {
+		req->dr_callback(req, req->dr_cbarg);
+	}
+
+	if (next == NULL) {
+		next = disksched_pick(ds);
+	}
+	ds->ds_active = next;
+	if (next != NULL) {
+		ds->ds_start(ds->ds_drv, next);
+	}
+}
+
+/*
+ * Perform the I/O described by UIO.
+ *
+ * Kernel buffers are submitted as they are, one request per iovec, so
+ * a page of swap or a file system block is a single request. Anything
+ * else (user buffers) is bounced through a kernel buffer,
+ * DISKSCHED_MAXBOUNCE bytes at a time, since the driver moves the data
+ * from its interrupt handler and cannot touch user memory.
+ */
+int
+disksched_io(struct disksched *ds, struct uio *uio)
+{
+	struct diskreq req;
+	struct iovec *iov;
+	char *bounce = NULL;
+	size_t len;
+	int result = 0;
+
+	KASSERT(uio->uio_offset % ds->ds_blocksize == 0);
+	KASSERT(uio->uio_resid % ds->ds_blocksize == 0);
+
+	req.dr_write = (uio->uio_rw == UIO_WRITE);
+
+	while (uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+
+		req.dr_block = uio->uio_offset / ds->ds_blocksize;
+
+		if (uio->uio_segflg == UIO_SYSSPACE &&
+		    iov->iov_len % ds->ds_blocksize == 0) {
+			/* Straight from the caller's buffer. */
+			len = iov->iov_len;
+			req.dr_buf = iov->iov_kbase;
+			req.dr_nblocks = len / ds->ds_blocksize;
+			result = disksched_submit(ds, &req);
+			if (result) {
+				break;
+			}
+			iov->iov_kbase = (char *)iov->iov_kbase + len;
+			iov->iov_len -= len;
+			uio->uio_offset += len;
+			uio->uio_resid -= len;
+			continue;
+		}
+
+		if (bounce == NULL) {
+			bounce = kmalloc(DISKSCHED_MAXBOUNCE);
+			if (bounce == NULL) {
+				return ENOMEM;
+			}
+		}
+
+		len = uio->uio_resid;
+		if (len > DISKSCHED_MAXBOUNCE) {
+			len = DISKSCHED_MAXBOUNCE;
+		}
+		req.dr_buf = bounce;
+		req.dr_nblocks = len / ds->ds_blocksize;
+
+		if (req.dr_write) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			result = disksched_submit(ds, &req);
+		}
+		else {
+			result = disksched_submit(ds, &req);
+			if (result == 0) {
+				result = uiomove(bounce, len, uio);
+			}
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
+	return result;
+}
+
+/*
+ * Print queue depth and service time statistics for all devices.
+ * The service time is measured from submission to completion, so it
+ * includes the time spent waiting in the queue.
+ */
+void
+disksched_printstats(void)
+{
+	struct disksched *ds;
+	uint32_t requests, blocks, dispatches, merged, maxdepth;
+	uint64_t depthsum, waitns;
+
+	for (ds = disksched_list; ds != NULL; ds = ds->ds_next) {
+		spinlock_acquire(&ds->ds_lock);
+		requests = ds->ds_requests;
+		blocks = ds->ds_blocks;
+		dispatches = ds->ds_dispatches;
+		merged = ds->ds_merged;
+		maxdepth = ds->ds_maxdepth;
+		depthsum = ds->ds_depthsum;
+		waitns = ds->ds_waitns;
+		spinlock_release(&ds->ds_lock);
+
+		kprintf("%s: %u requests, %u blocks, %u transfers "
+			"(%u requests chained)\n",
+			ds->ds_name, requests, blocks, dispatches, merged);
+		kprintf("%s: queue depth avg %u.%02u max %u, "
+			"avg service time %u us\n",
+			ds->ds_name,
+			requests ? (unsigned)(depthsum / requests) : 0,
+			requests ? (unsigned)(depthsum * 100 / requests % 100) : 0,
+			maxdepth,
+			requests ? (unsigned)(waitns / requests / 1000) : 0);
+	}
+}
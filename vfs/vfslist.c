@@ -94,6 +94,13 @@ static struct knowndevarray *knowndevs;
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
+/*
+ * Protects knowndevs (the array and kd_fs) against the lookups that
+ * read it. Changes are made holding both this and vfs_biglock, so
+ * code that holds vfs_biglock can read knowndevs without it.
+ */
+static struct rwlock *vfs_devlock;
+
 
 /*
  * Setup function
@@ -112,6 +119,13 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_devlock = rwlock_create("vfs_devlock");
+	if (vfs_devlock==NULL) {
+		panic("vfs: Could not create vfs device list lock\n");
+	}
+
+	vfs_nc_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -166,6 +180,34 @@ vfs_biglock_do_i_hold(void)
 	return lock_do_i_hold(vfs_biglock);
 }
 
+/*
+ * Operations on vfs_devlock.
+ */
+void
+vfs_devlock_acquire_read(void)
+{
+	rwlock_acquire_read(vfs_devlock);
+}
+
+void
+vfs_devlock_release_read(void)
+{
+	rwlock_release_read(vfs_devlock);
+}
+
+void
+vfs_devlock_acquire_write(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_write(vfs_devlock);
+}
+
+void
+vfs_devlock_release_write(void)
+{
+	rwlock_release_write(vfs_devlock);
+}
+
 /*
  * Global sync function - call FSOP_SYNC on all devices.
  */
@@ -193,6 +235,8 @@ vfs_sync(void)
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
+ *
+ * The caller holds vfs_devlock (for reading will do).
  */
 int
 vfs_getroot(const char *devname, struct vnode **ret)
@@ -200,8 +244,6 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -281,7 +323,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	vfs_devlock_acquire_read();
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -294,10 +336,12 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			vfs_devlock_release_read();
 			return kd->kd_name;
 		}
 	}
 
+	vfs_devlock_release_read();
 	return NULL;
 }
 
@@ -443,7 +487,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		goto fail;
 	}
 
+	vfs_devlock_acquire_write();
 	result = knowndevarray_add(knowndevs, kd, &index);
+	vfs_devlock_release_write();
 	if (result) {
 		goto fail;
 	}
@@ -567,7 +613,9 @@ vfs_mount(const char *devname, void *data,
 	KASSERT(fs != NULL);
 	KASSERT(fs != SWAP_FS); 
 
+	vfs_devlock_acquire_write();
 	kd->kd_fs = fs;
+	vfs_devlock_release_write();
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -617,7 +665,9 @@ vfs_swapon(const char *devname, struct vnode **ret)
 
 	kprintf("vfs: Swap attached to %s\n", kd->kd_name);
 
+	vfs_devlock_acquire_write();
 	kd->kd_fs = SWAP_FS;
+	vfs_devlock_release_write();
 	VOP_INCREF(kd->kd_vnode);
 	*ret = kd->kd_vnode;
 
@@ -654,15 +704,21 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* keep lookups from getting at the fs while it goes away */
+	vfs_devlock_acquire_write();
+
+	/* the name cache holds vnodes of the fs; let go of them */
+	vfs_nc_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
-		goto fail;
+		goto unlock;
 	}
 
 	result = FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
-		goto fail;
+		goto unlock;
 	}
 
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
@@ -672,6 +728,8 @@ vfs_unmount(const char *devname)
 
 	KASSERT(result==0);
 
+ unlock:
+	vfs_devlock_release_write();
  fail:
 	vfs_biglock_release();
 	return result;
@@ -705,7 +763,9 @@ vfs_swapoff(const char *devname)
 	kprintf("vfs: Swap detached from %s:\n", kd->kd_name);
 
 	/* drop it */
+	vfs_devlock_acquire_write();
 	kd->kd_fs = NULL;
+	vfs_devlock_release_write();
 
 	KASSERT(result==0);
 
@@ -725,6 +785,7 @@ vfs_unmountall(void)
 	int result;
 
 	vfs_biglock_acquire();
+	vfs_devlock_acquire_write();
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -745,6 +806,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_nc_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -780,6 +843,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
+	vfs_devlock_release_write();
 	vfs_biglock_release();
 
 	return 0;
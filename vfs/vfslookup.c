@@ -40,6 +40,7 @@
 #include <fs.h>
 #include <vnode.h>
 
+/* Protected by vfs_devlock. */
 static struct vnode *bootfs_vnode = NULL;
 
 /*
@@ -51,8 +52,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	vfs_devlock_acquire_write();
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	vfs_devlock_release_write();
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -123,6 +126,9 @@ vfs_clearbootfs(void)
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
+ *
+ * Called with vfs_devlock held for reading, which protects the device
+ * list and bootfs_vnode.
  */
 
 static
@@ -133,8 +139,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Entirely empty filenames aren't legal.
 	 */
@@ -234,6 +238,72 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up PATH relative to directory STARTVN, one component at a time,
+ * asking the name cache first and the file system (VOP_LOOKUP) only on
+ * a miss. Empty components (repeated or trailing slashes) are skipped.
+ * STARTVN keeps its reference; the vnode found comes with one.
+ *
+ * No VFS lock is held: the file systems lock their own directories,
+ * and the name cache ignores answers that raced with a removal.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, struct vnode **retval)
+{
+	struct vnode *dir, *vn;
+	size_t len;
+	char save;
+	unsigned gen;
+	int result;
+
+	VOP_INCREF(startvn);
+	dir = startvn;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			*retval = dir;
+			return 0;
+		}
+
+		/* Terminate the component in place. */
+		for (len=0; path[len] != 0 && path[len] != '/'; len++) {
+			/* nothing */
+		}
+		if (len > NAME_MAX) {
+			VOP_DECREF(dir);
+			return ENAMETOOLONG;
+		}
+		save = path[len];
+		path[len] = 0;
+
+		if (vfs_nc_lookup(dir, path, &vn, &gen)) {
+			result = (vn == NULL) ? ENOENT : 0;
+		}
+		else {
+			result = VOP_LOOKUP(dir, path, &vn);
+			if (result == 0) {
+				vfs_nc_enter(dir, path, vn, gen);
+			}
+			else if (result == ENOENT) {
+				vfs_nc_enter(dir, path, NULL, gen);
+			}
+		}
+
+		path[len] = save;
+		path += len;
+
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+	}
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -243,14 +313,15 @@ int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *last;
 	int result;
 
-	vfs_biglock_acquire();
-
+	/* Lookups only read the device list, so they can run together. */
+	vfs_devlock_acquire_read();
 	result = getdevice(path, &path, &startvn);
+	vfs_devlock_release_read();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -262,13 +333,27 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 */
 		result = EINVAL;
 	}
+	else if ((last = strrchr(path, '/')) != NULL && last[1] != 0) {
+		/*
+		 * Walk to the directory through the name cache and let
+		 * the file system check the last component.
+		 */
+		*last = 0;
+		result = lookup_walk(startvn, path, &dir);
+		*last = '/';
+		if (result == 0) {
+			result = VOP_LOOKPARENT(dir, last+1, retval,
+						buf, buflen);
+			VOP_DECREF(dir);
+		}
+	}
 	else {
+		/* Single component, or trailing slash: as it is. */
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
 	}
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -278,23 +363,20 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
+	vfs_devlock_acquire_read();
 	result = getdevice(path, &path, &startvn);
+	vfs_devlock_release_read();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -0,0 +1,361 @@
+/*
+ * VFS name cache.
+ *
+ * Remembers the results of looking up single path components: for a
+ * (directory vnode, name) pair, either the vnode found or the fact that
+ * the name does not exist (a negative entry). vfs_lookup and
+ * vfs_lookparent walk paths one component at a time through the cache
+ * and only call VOP_LOOKUP on a miss.
+ *
+ * Each entry holds a reference to its directory and to the vnode it
+ * names, so neither can be reclaimed (and its address reused) while it
+ * is cached. Entries are dropped when the name is changed through the
+ * VFS (vfs_nc_remove), when the file system is unmounted
+ * (vfs_nc_purgefs), and in LRU order when the cache is full.
+ *
+ * Names longer than VFS_NC_NAMELEN, ".", and ".." are not cached.
+ *
+ * The cache has its own lock, nc_lock, and is not held across
+ * VOP_LOOKUP, so a lookup can race with a rename or remove of the same
+ * name and try to enter a stale answer. To catch that, every removal
+ * bumps nc_gen: vfs_nc_lookup hands back the generation on a miss, and
+ * vfs_nc_enter discards the answer if it has changed since.
+ *
+ * Vnodes are released after dropping nc_lock, since releasing the last
+ * reference reclaims the vnode and the file system may take its own
+ * locks (or vfs_biglock, which vfs_nc_purgefs is called with) to do
+ * that.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define VFS_NC_SIZE	128	/* entries */
+#define VFS_NC_HASHSIZE	64	/* buckets (a power of 2) */
+#define VFS_NC_NAMELEN	31	/* longest name cached */
+
+struct nc_entry {
+	struct vnode *nc_dir;		/* directory (NULL if free) */
+	struct vnode *nc_vn;		/* vnode named, or NULL if none */
+	char nc_name[VFS_NC_NAMELEN+1];
+	struct nc_entry *nc_hashnext;	/* next in bucket */
+	struct nc_entry *nc_lrunext;	/* LRU list (or free list) */
+	struct nc_entry *nc_lruprev;
+};
+
+static struct nc_entry nc_entries[VFS_NC_SIZE];
+static struct nc_entry *nc_hash[VFS_NC_HASHSIZE];
+static struct nc_entry *nc_free;
+static struct nc_entry *nc_lruhead;	/* least recently used */
+static struct nc_entry *nc_lrutail;	/* most recently used */
+static struct lock *nc_lock;		/* protects everything here */
+static unsigned nc_gen;			/* bumped by every removal */
+
+/* Statistics */
+static uint32_t nc_hits;		/* found a vnode */
+static uint32_t nc_neghits;		/* found that the name doesn't exist */
+static uint32_t nc_misses;		/* had to ask the file system */
+static uint32_t nc_evictions;		/* entries recycled when full */
+
+/*
+ * Set up the free list.
+ */
+void
+vfs_nc_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lock = lock_create_adaptive("vfs_nc");
+	if (nc_lock == NULL) {
+		panic("vfs: Could not create the name cache lock\n");
+	}
+
+	for (i=0; i<VFS_NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_lrunext = nc_free;
+		nc_free = &nc_entries[i];
+	}
+}
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h & (VFS_NC_HASHSIZE - 1);
+}
+
+/*
+ * Whether a name can be cached. (Devices are left alone: they
+ * interpret the rest of the path themselves.)
+ */
+static
+bool
+nc_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL || strlen(name) > VFS_NC_NAMELEN) {
+		return false;
+	}
+	return strcmp(name, ".") && strcmp(name, "..");
+}
+
+static
+struct nc_entry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct nc_entry *e;
+
+	for (e = nc_hash[nc_hashfunc(dir, name)]; e != NULL;
+	     e = e->nc_hashnext) {
+		if (e->nc_dir == dir && !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+nc_lruremove(struct nc_entry *e)
+{
+	if (e->nc_lruprev != NULL) {
+		e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	}
+	else {
+		nc_lruhead = e->nc_lrunext;
+	}
+	if (e->nc_lrunext != NULL) {
+		e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+	}
+	else {
+		nc_lrutail = e->nc_lruprev;
+	}
+}
+
+static
+void
+nc_lruappend(struct nc_entry *e)
+{
+	e->nc_lrunext = NULL;
+	e->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = e;
+	}
+	else {
+		nc_lruhead = e;
+	}
+	nc_lrutail = e;
+}
+
+/*
+ * Drop an entry, handing back its vnodes in *DIR and *VN, to be
+ * released with nc_release once nc_lock has been dropped.
+ */
+static
+void
+nc_drop(struct nc_entry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct nc_entry **pp;
+
+	KASSERT(lock_do_i_hold(nc_lock));
+
+	pp = &nc_hash[nc_hashfunc(e->nc_dir, e->nc_name)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = e->nc_hashnext;
+	nc_lruremove(e);
+
+	*dir = e->nc_dir;
+	*vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+	e->nc_lrunext = nc_free;
+	nc_free = e;
+}
+
+/*
+ * Release the vnodes of a dropped entry (either may be NULL).
+ */
+static
+void
+nc_release(struct vnode *dir, struct vnode *vn)
+{
+	KASSERT(!lock_do_i_hold(nc_lock));
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Look up NAME in directory DIR. Returns true if the cache knows the
+ * answer, in which case *RET is the vnode (with a reference added) or
+ * NULL if the name doesn't exist. Otherwise *GEN is set to what must be
+ * passed to vfs_nc_enter with the answer.
+ */
+bool
+vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+	      unsigned *gen)
+{
+	struct nc_entry *e;
+
+	lock_acquire(nc_lock);
+
+	e = nc_cacheable(dir, name) ? nc_find(dir, name) : NULL;
+	if (e == NULL) {
+		nc_misses++;
+		*gen = nc_gen;
+		lock_release(nc_lock);
+		return false;
+	}
+
+	nc_lruremove(e);
+	nc_lruappend(e);
+
+	if (e->nc_vn == NULL) {
+		nc_neghits++;
+	}
+	else {
+		nc_hits++;
+		VOP_INCREF(e->nc_vn);
+	}
+	*ret = e->nc_vn;
+	lock_release(nc_lock);
+	return true;
+}
+
+/*
+ * Remember that NAME in directory DIR is VN (NULL: doesn't exist), as
+ * found after vfs_nc_lookup returned GEN. Nothing is remembered if a
+ * name has been removed since.
+ */
+void
+vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct nc_entry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	struct vnode *lrudir = NULL, *lruvn = NULL;
+	unsigned h;
+
+	if (!nc_cacheable(dir, name)) {
+		return;
+	}
+
+	lock_acquire(nc_lock);
+
+	if (gen != nc_gen) {
+		lock_release(nc_lock);
+		return;
+	}
+
+	e = nc_find(dir, name);
+	if (e != NULL) {
+		nc_drop(e, &olddir, &oldvn);
+	}
+
+	if (nc_free == NULL) {
+		KASSERT(nc_lruhead != NULL);
+		nc_drop(nc_lruhead, &lrudir, &lruvn);
+		nc_evictions++;
+	}
+	e = nc_free;
+	nc_free = e->nc_lrunext;
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_dir = dir;
+	e->nc_vn = vn;
+	strcpy(e->nc_name, name);
+
+	h = nc_hashfunc(dir, name);
+	e->nc_hashnext = nc_hash[h];
+	nc_hash[h] = e;
+	nc_lruappend(e);
+
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+	nc_release(lrudir, lruvn);
+}
+
+/*
+ * Forget NAME in directory DIR. Called after anything that may have
+ * changed what the name refers to.
+ */
+void
+vfs_nc_remove(struct vnode *dir, const char *name)
+{
+	struct nc_entry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	e = nc_cacheable(dir, name) ? nc_find(dir, name) : NULL;
+	if (e != NULL) {
+		nc_drop(e, &olddir, &oldvn);
+	}
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+/*
+ * Forget everything about file system FS, so that it can be unmounted.
+ */
+void
+vfs_nc_purgefs(struct fs *fs)
+{
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* One at a time, since the vnodes are released without nc_lock. */
+	for (i=0; i<VFS_NC_SIZE; i++) {
+		lock_acquire(nc_lock);
+		if (nc_entries[i].nc_dir == NULL ||
+		    nc_entries[i].nc_dir->vn_fs != fs) {
+			lock_release(nc_lock);
+			continue;
+		}
+		nc_gen++;
+		nc_drop(&nc_entries[i], &dir, &vn);
+		lock_release(nc_lock);
+
+		nc_release(dir, vn);
+	}
+}
+
+/*
+ * Print the name cache statistics.
+ */
+void
+vfs_nc_printstats(void)
+{
+	uint32_t lookups;
+
+	lock_acquire(nc_lock);
+	lookups = nc_hits + nc_neghits + nc_misses;
+	kprintf("vfs name cache: %u lookups, %u hits, %u negative hits "
+		"(%u%%)\n", lookups, nc_hits, nc_neghits,
+		lookups ? (unsigned)((nc_hits + nc_neghits) * 100ULL /
+				     lookups) : 0);
+	kprintf("vfs name cache: %u misses, %u entries recycled\n",
+		nc_misses, nc_evictions);
+	lock_release(nc_lock);
+}
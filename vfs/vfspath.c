@@ -40,6 +40,13 @@
 #include <vnode.h>
 
 
+/*
+ * The operations that change names drop the name from the name cache
+ * afterwards. A lookup that raced with the change and is about to cache
+ * what the name referred to before it is caught by the name cache's
+ * generation count.
+ */
+
 /* Does most of the work for open(). */
 int
 vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
@@ -74,6 +81,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		vfs_nc_remove(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -146,6 +154,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_nc_remove(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +188,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_nc_remove(olddir, oldname);
+	vfs_nc_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +224,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_nc_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +252,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_nc_remove(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +299,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_nc_remove(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -308,6 +322,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_nc_remove(parent, name);
 
 	VOP_DECREF(parent);
 
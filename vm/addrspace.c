@@ -38,6 +38,8 @@
 #include "spl.h"
 #include "mips/tlb.h"
 #include <cpu.h>
+#include <slab.h>
+#include <synch.h>
 #include "opt-final.h"
 #include "vm_tlb.h"
 #include "vmstats.h"
@@ -82,12 +84,31 @@ getppages(unsigned long npages)//allocates pages from RAM
 	return addr;
 }
 
+static struct slab_cache *asCache;	//address spaces are allocated from here (one per fork)
+
+//The region lock is created once per cached address space and kept while it is free
+static int asCtor(void *obj){
+	struct addrspace *as = obj;
+
+	as->as_lock = rwlock_create("addrspace");
+	if(as->as_lock == NULL){
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void asDtor(void *obj){
+	struct addrspace *as = obj;
+
+	rwlock_destroy(as->as_lock);
+}
+
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
 
-	as = kmalloc(sizeof(struct addrspace));
+	as = slab_alloc(asCache);
 	if (as == NULL) {
 		return NULL;
 	}
@@ -112,6 +133,7 @@ as_copy(struct addrspace *src, struct addrspace **ret, pid_t oldPid, pid_t newPi
 	}
 
 	//Assigning old address space to the new address space
+	rwlock_acquire_read(src->as_lock);
 	newAddrSpace->as_vbase1 = src->as_vbase1;
 	newAddrSpace->as_npages1 = src->as_npages1;
 	newAddrSpace->as_vbase2 = src->as_vbase2;
@@ -129,6 +151,7 @@ as_copy(struct addrspace *src, struct addrspace **ret, pid_t oldPid, pid_t newPi
 
 	newAddrSpace->initial_offset_text = src->initial_offset_text;
 	newAddrSpace->initial_offset_data = src->initial_offset_data;
+	rwlock_release_read(src->as_lock);
 
 	prepareCopyPT(oldPid);			
 	duplicateSwapPages(newPid, oldPid);		//Copying the swap pages
@@ -148,7 +171,7 @@ void as_destroy(struct addrspace *as){
 		as->v->vn_refcount--; 	//decreasing the number of processes related to the ELF file
 	}
 
-	kfree(as);
+	slab_free(asCache, as);
 }
 
 void
@@ -198,11 +221,14 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize, int re
 	(void)writeable;
 	(void)executable;
 
+	rwlock_acquire_write(as->as_lock);
+
 	if (as->as_vbase1 == 0) {								//region not yet defined
 		DEBUG(DB_VM,"\nText starts at: 0x%x\n",vaddr);
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
 		as->initial_offset_text=initial_offset;
+		rwlock_release_write(as->as_lock);
 		return 0;
 	}
 
@@ -211,9 +237,11 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize, int re
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
 		as->initial_offset_data=initial_offset;
+		rwlock_release_write(as->as_lock);
 		return 0;
 	}
 
+	rwlock_release_write(as->as_lock);
 	kprintf("Too many regions at once\n");	//only one region at a time is possible
 
 	return ENOSYS;
@@ -249,6 +277,10 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr){
 
 
 void vm_bootstrap(void){
+	asCache = slab_cache_create("addrspace", sizeof(struct addrspace), asCtor, asDtor);
+	if(asCache == NULL){
+		panic("vm_bootstrap: cannot create the address space cache\n");
+	}
 	initPT();
 	initSwapfile();
 	initializeStatistics();
@@ -314,6 +346,33 @@ void free_kpages(vaddr_t addr){
     splx(spl);
 }
 
+#define VM_MAX_RECLAIMERS 4
+
+static int (*reclaimers[VM_MAX_RECLAIMERS])(unsigned);
+static int nReclaimers = 0;
+
+/*
+ * Register a function that releases pages of a kernel cache.
+ */
+void vm_register_reclaim(int (*reclaim)(unsigned npages)){
+    KASSERT(nReclaimers < VM_MAX_RECLAIMERS);
+    reclaimers[nReclaimers++] = reclaim;
+}
+
+/*
+ * Ask the kernel caches to release up to npages pages.
+ * Returns the number of pages released.
+ */
+int vm_reclaim(unsigned npages){
+    int i, freed = 0;
+
+    for(i=0; i<nReclaimers && (unsigned)freed<npages; i++){
+        freed += reclaimers[i](npages - freed);
+    }
+    return freed;
+}
+
+//The caller holds the region lock for reading
 int as_is_correct(void){
     struct addrspace *as = proc_getas();
     if(as == NULL)
@@ -333,6 +392,8 @@ void vm_shutdown(void){
 	
 	// print statistics
 	printStatistics();
+	printSwapDevices();
+	printSwapCacheStatistics();
 }
 
 void createSemFork(void){
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-final.h"
 #if OPT_FINAL
 #include "addrspace.h"
@@ -78,9 +82,17 @@ fill_deadbeef(void *vptr, size_t len)
 //    sizes, and large numbers of items of the new size are allocated.
 //
 //    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    another table (of "pagerefs"). Maintaining this table is a
+//    nuisance, because it cannot recursively use the subpage
+//    allocator. (We could probably make that work, but it would be
+//    painful.)
+//
+//    The pageref of each heap page is also recorded by physical page
+//    number in kheap_pagerefs, so the page a block belongs to is found
+//    without searching. Each block size keeps a list of only the pages
+//    that have free blocks, and the block size for a request is looked
+//    up in a table, so neither kmalloc nor kfree has to walk anything
+//    that grows with the size of the heap.
 //
 
 ////////////////////////////////////////
@@ -115,6 +127,10 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * MAGAZINES (on unless GUARDS or LABELS is, since those wrap each
+ * allocation) serves most subpage allocations from per-cpu caches of
+ * free blocks; see below.
  */
 
 #undef  SLOW
@@ -125,6 +141,10 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -148,8 +168,8 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_samesize;	/* partial list of the size */
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -164,13 +184,12 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole heap. With MAGAZINES most allocations
+ * and frees are served per-cpu and only take it to move blocks in
+ * batches.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_FAIR_INITIALIZER;
 
 ////////////////////////////////////////
 
@@ -343,11 +362,72 @@ freepageref(struct pageref *p)
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * The pages of each block size that have at least one free block, as
+ * a doubly-linked list so that a page can be taken off it when it
+ * fills up or becomes entirely free.
  */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+/*
+ * The pageref of each heap page (NULL if none), by physical page
+ * number. Set and cleared under kmalloc_spinlock as pages are added to
+ * and removed from the heap. With MAGAZINES, kfree also reads it
+ * without the spinlock to tell the block size of a pointer.
+ *
+ * This covers the same 16M as the pagerefs; subpage_kmalloc does not
+ * use pages past it.
+ */
+#define KHEAP_NPAGES TOTAL_PAGEREFS
+static struct pageref *kheap_pagerefs[KHEAP_NPAGES];
+
+#define KHEAP_PAGENUM(va) (KVADDR_TO_PADDR(va) / PAGE_SIZE)
+
+/*
+ * Size class lookup: for a size rounded up to a multiple of
+ * SMALLEST_SUBPAGE_SIZE, the index into sizes[] of the smallest block
+ * that holds it. Must agree with sizes[]; kheap_bootstrap checks.
+ */
+#define SIZECLASS_INDEX(sz) (((sz) + SMALLEST_SUBPAGE_SIZE - 1) / \
+			     SMALLEST_SUBPAGE_SIZE)
+#define NSIZECLASSES (LARGEST_SUBPAGE_SIZE / SMALLEST_SUBPAGE_SIZE + 1)
+
+static const uint8_t sizeclasses[NSIZECLASSES] = {
+	0, 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4,	/*    0 -  240 */
+	4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,	/*  256 -  496 */
+	5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	/*  512 -  752 */
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	/*  768 - 1008 */
+	6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,	/* 1024 - 1264 */
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,	/* 1280 - 1520 */
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,	/* 1536 - 1776 */
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,	/* 1792 - 2032 */
+	7,						/* 2048 */
+};
+
+#ifdef MAGAZINES
+/*
+ * Per-cpu magazines (see below).
+ */
+#define MAG_SIZE	16	/* blocks per magazine */
+#define MAG_BATCH	8	/* blocks moved at a time */
+
+struct kmalloc_mag {
+	unsigned m_count;		/* blocks in the magazine */
+	void *m_blocks[MAG_SIZE];	/* most recently freed last */
+};
+
+struct kmalloc_cpu {
+	struct kmalloc_mag kc_mags[NSIZES];
+
+	/* Statistics */
+	uint32_t kc_allocs;		/* allocations from the magazines */
+	uint32_t kc_frees;		/* frees into the magazines */
+	uint32_t kc_refills;		/* batches taken from the heap */
+	uint32_t kc_flushes;		/* batches given back */
+};
+
+static struct kmalloc_cpu kmalloc_cpus[MAXCPUS];
+static bool kheap_magazines;		/* set by kheap_bootstrap */
+#endif
 
 ////////////////////////////////////////
 
@@ -577,14 +657,15 @@ checksubpage(struct pageref *pr)
 #ifdef SLOWER
 /*
  * Run checksubpage on all heap pages. This also checks that the
- * linked lists of pagerefs are more or less intact.
+ * linked lists of pagerefs are more or less intact: they should hold
+ * exactly the pages that have free blocks.
  */
 static
 void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
+	unsigned i;
 	unsigned sc=0, ac=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
@@ -592,15 +673,25 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
+			KASSERT(PR_BLOCKTYPE(pr) == i);
+			KASSERT(pr->nfree > 0);
+			KASSERT(pr->next_samesize == NULL ||
+				pr->next_samesize->prev_samesize == pr);
 			KASSERT(sc < TOTAL_PAGEREFS);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (i=0; i<KHEAP_NPAGES; i++) {
+		pr = kheap_pagerefs[i];
+		if (pr == NULL) {
+			continue;
+		}
+		KASSERT(KHEAP_PAGENUM(PR_PAGEADDR(pr)) == i);
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
+		if (pr->nfree > 0) {
+			ac++;
+		}
 	}
 
 	KASSERT(sc==ac);
@@ -685,11 +776,12 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
+	unsigned i;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+	for (i=0; i<KHEAP_NPAGES; i++) {
+		pr = kheap_pagerefs[i];
+		if (pr != NULL) {
 			dump_subpage(pr, generation);
 		}
 	}
@@ -805,14 +897,31 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
+#ifdef MAGAZINES
+	uint32_t allocs = 0, frees = 0, refills = 0, flushes = 0;
+
+	/* (Other cpus may be updating their counts; this is approximate.) */
+	for (i=0; i<MAXCPUS; i++) {
+		allocs += kmalloc_cpus[i].kc_allocs;
+		frees += kmalloc_cpus[i].kc_frees;
+		refills += kmalloc_cpus[i].kc_refills;
+		flushes += kmalloc_cpus[i].kc_flushes;
+	}
+	kprintf("Magazines: %u allocations, %u frees, %u refills, "
+		"%u flushes\n", allocs, frees, refills, flushes);
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
+	for (i=0; i<KHEAP_NPAGES; i++) {
+		pr = kheap_pagerefs[i];
+		if (pr != NULL) {
+			subpage_stats(pr);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
@@ -821,31 +930,46 @@ kheap_printstats(void)
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Put a page that has (just got) free blocks on the list for its size.
  */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+sizelist_add(struct pageref *pr)
 {
-	struct pageref **guy;
+	struct pageref **head;
 
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	head = &sizebases[PR_BLOCKTYPE(pr)];
+	pr->prev_samesize = NULL;
+	pr->next_samesize = *head;
+	if (*head != NULL) {
+		(*head)->prev_samesize = pr;
 	}
+	*head = pr;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+/*
+ * Take a page off the list for its size, because it has no free
+ * blocks left or is about to be freed.
+ */
+static
+void
+sizelist_remove(struct pageref *pr)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
 	}
+	else {
+		KASSERT(sizebases[PR_BLOCKTYPE(pr)] == pr);
+		sizebases[PR_BLOCKTYPE(pr)] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
 }
 
 /*
@@ -856,18 +980,50 @@ static
 inline
 int blocktype(size_t clientsz)
 {
-	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (clientsz <= sizes[i]) {
-			return i;
-		}
+	if (clientsz > LARGEST_SUBPAGE_SIZE) {
+		panic("Subpage allocator cannot handle allocation of size "
+		      "%zu\n", clientsz);
 	}
+	return sizeclasses[SIZECLASS_INDEX(clientsz)];
+}
+
+/*
+ * Take a block off the freelist of page PR, which must have one. The
+ * page leaves the list for its size when its last block is taken.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
 
-	panic("Subpage allocator cannot handle allocation of size %zu\n",
-	      clientsz);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-	// keep compiler happy
-	return 0;
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		sizelist_remove(pr);
+	}
+	return retptr;
 }
 
 /*
@@ -915,47 +1071,28 @@ subpage_kmalloc(size_t sz
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	/* Every page on the list has a free block; take the first. */
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	doalloc: /* comes here after getting a whole fresh page */
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		retptr = subpage_takeblock(pr);
 #ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
+		retptr = establishguardband(retptr, clientsz, sz);
 #endif
 #ifdef LABELS
-			retptr = establishlabel(retptr, label);
+		retptr = establishlabel(retptr, label);
 #endif
 
-			checksubpages();
+		checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -979,6 +1116,13 @@ subpage_kmalloc(size_t sz
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
+	if (KHEAP_PAGENUM(prpage) >= KHEAP_NPAGES) {
+		/* Beyond the memory the heap can keep track of. */
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator got a page past %uM\n",
+			KHEAP_NPAGES * PAGE_SIZE / (1024 * 1024));
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
@@ -1011,16 +1155,110 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	sizelist_add(pr);
+	KASSERT(kheap_pagerefs[KHEAP_PAGENUM(prpage)] == NULL);
+	kheap_pagerefs[KHEAP_PAGENUM(prpage)] = pr;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the heap page holding address PTRADDR. Returns NULL if it is not
+ * on any of our pages.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for the page
+	unsigned pagenum;	// physical page number of ptraddr
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+#ifdef __mips__
+	if (ptraddr < MIPS_KSEG0 || ptraddr >= MIPS_KSEG1) {
+		return NULL;
+	}
+#endif
+	pagenum = KHEAP_PAGENUM(ptraddr);
+	if (pagenum >= KHEAP_NPAGES) {
+		return NULL;
+	}
+	pr = kheap_pagerefs[pagenum];
+	if (pr != NULL) {
+		/* check for corruption */
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+	}
+	return pr;
+}
+
+/*
+ * Put the (checked and deadbeefed) block at PTRADDR back on the
+ * freelist of its page PR. If that leaves the whole page free, the
+ * page is taken off the lists and its address returned, to be given to
+ * free_kpages once kmalloc_spinlock is released; otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		/* Was full; it has a free block again. */
+		fl->next = NULL;
+		sizelist_add(pr);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		sizelist_remove(pr);
+		kheap_pagerefs[KHEAP_PAGENUM(prpage)] = NULL;
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1033,9 +1271,8 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to give back, or 0
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1069,30 +1306,15 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1112,55 +1334,236 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	freepage = subpage_putblock(pr, ptraddr);
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
+	}
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 #endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a magazine: a small stack of
+//    free blocks that it hands out and takes back with interrupts off
+//    but without kmalloc_spinlock. An empty magazine is refilled with
+//    up to MAG_BATCH blocks taken off the heap pages, and a full one
+//    gives its MAG_BATCH oldest blocks back, each time under one
+//    acquisition of the spinlock. Blocks sitting in magazines count as
+//    allocated as far as the heap pages are concerned, so a page is
+//    only given back once its blocks have been flushed.
+//
+//    kfree gets the block size from the page's entry in kheap_pagerefs.
+//    The entry cannot change under it, as the page has at least one
+//    allocated block: the one being freed.
+//
+
+#ifdef MAGAZINES
+
+/*
+ * Fill the (empty) magazine M with blocks of type BLKTYPE from the heap
+ * pages that have free ones. Does not allocate new pages.
+ */
+static
+void
+mag_refill(struct kmalloc_mag *m, unsigned blktype)
+{
+	struct pageref *pr;
+
+	KASSERT(m->m_count == 0);
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	/* Pages leave the list as they run out of free blocks. */
+	while ((pr = sizebases[blktype]) != NULL && m->m_count < MAG_BATCH) {
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		m->m_blocks[m->m_count++] = subpage_takeblock(pr);
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Give blocks that have been taken out of a magazine back to their
+ * pages, freeing any page that becomes entirely free.
+ */
+static
+void
+mag_flush(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_BATCH];
+	unsigned i, nfreepages;
+	struct pageref *pr;
+	vaddr_t freepage;
+
+	KASSERT(n <= MAG_BATCH);
+	nfreepages = 0;
+
 	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		pr = subpage_findpage((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL);
+		freepage = subpage_putblock(pr, (vaddr_t)blocks[i]);
+		if (freepage != 0) {
+			freepages[nfreepages++] = freepage;
+		}
+	}
+
 	checksubpages();
+
+	/* Call free_kpages without kmalloc_spinlock. */
 	spinlock_release(&kmalloc_spinlock);
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's magazine. Returns
+ * NULL if neither the magazine nor the existing heap pages have one.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct kmalloc_mag *m;
+	void *ptr;
+	int spl;
+
+	ptr = NULL;
+
+	/* Interrupts off: nothing else can use this cpu's magazines. */
+	spl = splhigh();
+
+	kc = &kmalloc_cpus[curcpu->c_number];
+	m = &kc->kc_mags[blktype];
+	if (m->m_count == 0) {
+		mag_refill(m, blktype);
+		kc->kc_refills++;
+	}
+	if (m->m_count > 0) {
+		ptr = m->m_blocks[--m->m_count];
+		kc->kc_allocs++;
+	}
+
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Free a block into this cpu's magazine. Returns false if PTR is not
+ * on a subpage heap page.
+ */
+static
+bool
+mag_free(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	struct kmalloc_cpu *kc;
+	struct kmalloc_mag *m;
+	struct pageref *pr;
+	void *flush[MAG_BATCH];
+	unsigned pagenum, blktype, nflush;
+	int spl;
+
+#ifdef __mips__
+	if (ptraddr < MIPS_KSEG0 || ptraddr >= MIPS_KSEG1) {
+		return false;
+	}
 #endif
+	pagenum = KHEAP_PAGENUM(ptraddr);
+	if (pagenum >= KHEAP_NPAGES) {
+		return false;
+	}
+	pr = kheap_pagerefs[pagenum];
+	if (pr == NULL) {
+		return false;
+	}
+	blktype = PR_BLOCKTYPE(pr);
 
-	return 0;
+	/* Check for proper alignment */
+	if (ptraddr % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	nflush = 0;
+
+	/* Interrupts off: nothing else can use this cpu's magazines. */
+	spl = splhigh();
+
+	kc = &kmalloc_cpus[curcpu->c_number];
+	m = &kc->kc_mags[blktype];
+	if (m->m_count == MAG_SIZE) {
+		/* Take out the oldest blocks; the newest are cache-hot. */
+		memcpy(flush, m->m_blocks, sizeof(flush));
+		memmove(m->m_blocks, m->m_blocks + MAG_BATCH,
+			(MAG_SIZE - MAG_BATCH) * sizeof(m->m_blocks[0]));
+		m->m_count -= MAG_BATCH;
+		nflush = MAG_BATCH;
+		kc->kc_flushes++;
+	}
+	m->m_blocks[m->m_count++] = ptr;
+	kc->kc_frees++;
+
+	splx(spl);
+
+	if (nflush > 0) {
+		mag_flush(flush, nflush);
+	}
+	return true;
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Check the size class table and turn on the magazines, now that
+ * curcpu can be used.
+ */
+void
+kheap_bootstrap(void)
+{
+	size_t sz;
+	unsigned i;
+
+	for (sz = 1; sz <= LARGEST_SUBPAGE_SIZE; sz++) {
+		for (i = 0; sz > sizes[i]; i++) {
+			/* nothing */
+		}
+		KASSERT(blocktype(sz) == (int)i);
+	}
+
+#ifdef MAGAZINES
+	kheap_magazines = true;
+#endif
 }
 
 //
@@ -1202,6 +1605,18 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	if (kheap_magazines) {
+		void *ptr;
+
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+		/* Otherwise the heap needs a new page. */
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1220,7 +1635,13 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (kheap_magazines && mag_free(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -34,7 +34,7 @@ void initPT(void){
         panic("Error on allocating the Inverted Page Table");
     }
 
-    pt_info.pt_lock = lock_create("pagetable-lock");
+    pt_info.pt_lock = lock_create_adaptive("pagetable-lock");
     if(pt_info.pt_lock==NULL){
         panic("Error. Lock hasn't been initialized");
     }
@@ -122,7 +122,7 @@ paddr_t getFramePT(vaddr_t v_addr){
 int findVictim(vaddr_t v_addr, pid_t pid){
 
     // circular buffer implementation
-    int i, end = next_victim, n = 0, old_vdty = 0; 
+    int i, j, end = next_victim, n = 0, old_vdty = 0; 
     vaddr_t old_vaddr;
     pid_t old_pid;
 
@@ -169,7 +169,18 @@ int findVictim(vaddr_t v_addr, pid_t pid){
                 continue;
             }
             else {
-                // victim is still not found, let's wait for freed pages by other processes
+                // victim is still not found: before waiting, ask the kernel caches to give frames back
+                if(vm_reclaim(1) > 0){
+                    j = findFreeEntryPT();
+                    if(j != -1){
+                        pt_info.pt[j].ctl = 0;
+                        addInPT(v_addr, pid, j);
+                        pt_info.pt[j].ctl = SET_IOBITONE(pt_info.pt[j].ctl); // start I/O operation
+                        pt_info.pt[j].ctl = SET_VALBITONE(pt_info.pt[j].ctl); // now the entry is valid
+                        return j;
+                    }
+                }
+                // let's wait for freed pages by other processes
                 lock_acquire(pt_info.pt_lock);
                 cv_wait(pt_info.pt_cv, pt_info.pt_lock);
                 lock_release(pt_info.pt_lock);
@@ -365,6 +376,8 @@ paddr_t getContiguousPages(int nPages){
 
         if(firstIteration<2){ //We perform 2 full iterations in order to have a complete execution of the second chance algorithm
             firstIteration++;
+        }else if(vm_reclaim(nPages) > 0){
+            firstIteration=0; //The kernel caches gave some frames back: search again before sleeping
         }else{
             lock_acquire(pt_info.pt_lock);
             cv_wait(pt_info.pt_cv,pt_info.pt_lock); //If after 2 complete iterations we didn't find a suitable interval we sleep until when something changes
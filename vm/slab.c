@@ -0,0 +1,397 @@
+/*
+ * Object caches.
+ *
+ * Each slab is one page from alloc_kpages. The page starts with a
+ * struct slab, followed by the indexes of its free objects (a stack),
+ * followed by the objects. Keeping the free list out of the objects
+ * means nothing in a free object is overwritten, so its constructed
+ * state survives until the slab is destroyed.
+ *
+ * A cache keeps its slabs on three lists: partially used, full, and
+ * empty. Objects are allocated from partial slabs first, so that
+ * empty ones can be given back; at most SLAB_MAXEMPTY empty slabs are
+ * kept around. Constructors and destructors are run, and pages are
+ * allocated and freed, without the cache's spinlock held, so they may
+ * sleep (e.g. lock_create).
+ *
+ * The slab of an object is found by masking its address with
+ * PAGE_FRAME.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/* Empty slabs kept for reuse, per cache */
+#define SLAB_MAXEMPTY	1
+
+/* Alignment of objects */
+#define SLAB_ALIGN	8
+
+struct slab {
+	struct slab_cache *sl_cache;	/* Cache this slab belongs to */
+	struct slab *sl_next;		/* Next slab on the same list */
+	struct slab *sl_prev;		/* Previous slab on the same list */
+	struct slab **sl_list;		/* List the slab is on */
+	unsigned sl_inuse;		/* Objects allocated */
+	unsigned sl_nfree;		/* Entries in sl_free */
+	uint16_t sl_free[];		/* Indexes of free objects */
+};
+
+struct slab_cache {
+	char *sc_name;
+	size_t sc_objsize;		/* Object size, rounded up */
+	unsigned sc_perslab;		/* Objects per slab */
+	size_t sc_objoff;		/* Offset of the first object */
+	int (*sc_ctor)(void *);
+	void (*sc_dtor)(void *);
+
+	struct spinlock sc_lock;	/* Protects everything below */
+	struct slab *sc_partial;	/* Slabs with some objects free */
+	struct slab *sc_full;		/* Slabs with no objects free */
+	struct slab *sc_empty;		/* Slabs with no objects in use */
+	unsigned sc_nslabs;		/* Slabs in all three lists */
+	unsigned sc_nempty;		/* Slabs in sc_empty */
+	unsigned sc_inuse;		/* Objects allocated */
+
+	/* Statistics */
+	uint32_t sc_allocs;		/* slab_alloc calls that succeeded */
+	uint32_t sc_frees;		/* slab_free calls */
+	uint32_t sc_grows;		/* Slabs created */
+	uint32_t sc_reaps;		/* Slabs destroyed */
+
+	struct slab_cache *sc_next;	/* Next cache (for statistics) */
+};
+
+/* All caches, for slab_printstats. */
+static struct slab_cache *slab_caches;
+static struct spinlock slab_cacheslock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Slab lists (called with sc_lock held)
+
+static
+void
+slab_listremove(struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		*sl->sl_list = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_list = NULL;
+}
+
+static
+void
+slab_listadd(struct slab **list, struct slab *sl)
+{
+	KASSERT(sl->sl_list == NULL);
+
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
+	}
+	*list = sl;
+	sl->sl_list = list;
+}
+
+static
+void
+slab_move(struct slab_cache *sc, struct slab *sl, struct slab **list)
+{
+	if (sl->sl_list == list) {
+		return;
+	}
+	if (sl->sl_list == &sc->sc_empty) {
+		sc->sc_nempty--;
+	}
+	slab_listremove(sl);
+	slab_listadd(list, sl);
+	if (list == &sc->sc_empty) {
+		sc->sc_nempty++;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Creating and destroying slabs (called without sc_lock)
+
+static
+void *
+slab_obj(struct slab_cache *sc, struct slab *sl, unsigned index)
+{
+	return (char *)sl + sc->sc_objoff + index * sc->sc_objsize;
+}
+
+/*
+ * Get a page and construct all its objects. Returns NULL if out of
+ * memory or if a constructor fails.
+ */
+static
+struct slab *
+slab_create(struct slab_cache *sc)
+{
+	struct slab *sl;
+	vaddr_t va;
+	unsigned i, j;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	sl = (struct slab *)va;
+
+	if (sc->sc_ctor != NULL) {
+		for (i = 0; i < sc->sc_perslab; i++) {
+			if (sc->sc_ctor(slab_obj(sc, sl, i))) {
+				for (j = 0; j < i; j++) {
+					if (sc->sc_dtor != NULL) {
+						sc->sc_dtor(slab_obj(sc, sl, j));
+					}
+				}
+				free_kpages(va);
+				return NULL;
+			}
+		}
+	}
+
+	sl->sl_cache = sc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_list = NULL;
+	sl->sl_inuse = 0;
+	/* Hand out the lowest-addressed objects first. */
+	for (i = 0; i < sc->sc_perslab; i++) {
+		sl->sl_free[i] = sc->sc_perslab - 1 - i;
+	}
+	sl->sl_nfree = sc->sc_perslab;
+
+	return sl;
+}
+
+/*
+ * Destruct all the objects of an empty slab and give its page back.
+ */
+static
+void
+slab_destroy(struct slab_cache *sc, struct slab *sl)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_inuse == 0);
+	KASSERT(sl->sl_list == NULL);
+
+	if (sc->sc_dtor != NULL) {
+		for (i = 0; i < sc->sc_perslab; i++) {
+			sc->sc_dtor(slab_obj(sc, sl, i));
+		}
+	}
+	sl->sl_cache = NULL;
+	free_kpages((vaddr_t)sl);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+struct slab_cache *
+slab_cache_create(const char *name, size_t objsize,
+		  int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct slab_cache *sc;
+	size_t hdr;
+	unsigned n;
+
+	KASSERT(objsize > 0 && objsize <= SLAB_MAXOBJ);
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return NULL;
+	}
+	sc->sc_name = kstrdup(name);
+	if (sc->sc_name == NULL) {
+		kfree(sc);
+		return NULL;
+	}
+
+	sc->sc_objsize = ROUNDUP(objsize, SLAB_ALIGN);
+
+	/* Fit as many objects as possible after the header. */
+	n = PAGE_SIZE / sc->sc_objsize;
+	while (1) {
+		hdr = ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t),
+			      SLAB_ALIGN);
+		if (hdr + n * sc->sc_objsize <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	KASSERT(n > 0);
+	sc->sc_perslab = n;
+	sc->sc_objoff = hdr;
+
+	sc->sc_ctor = ctor;
+	sc->sc_dtor = dtor;
+
+	spinlock_init(&sc->sc_lock);
+	sc->sc_partial = sc->sc_full = sc->sc_empty = NULL;
+	sc->sc_nslabs = 0;
+	sc->sc_nempty = 0;
+	sc->sc_inuse = 0;
+
+	sc->sc_allocs = 0;
+	sc->sc_frees = 0;
+	sc->sc_grows = 0;
+	sc->sc_reaps = 0;
+
+	spinlock_acquire(&slab_cacheslock);
+	sc->sc_next = slab_caches;
+	slab_caches = sc;
+	spinlock_release(&slab_cacheslock);
+
+	return sc;
+}
+
+void
+slab_cache_destroy(struct slab_cache *sc)
+{
+	struct slab_cache **pp;
+	struct slab *sl;
+
+	KASSERT(sc->sc_inuse == 0);
+	KASSERT(sc->sc_partial == NULL);
+	KASSERT(sc->sc_full == NULL);
+
+	spinlock_acquire(&slab_cacheslock);
+	for (pp = &slab_caches; *pp != sc; pp = &(*pp)->sc_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sc->sc_next;
+	spinlock_release(&slab_cacheslock);
+
+	while ((sl = sc->sc_empty) != NULL) {
+		slab_listremove(sl);
+		slab_destroy(sc, sl);
+	}
+
+	spinlock_cleanup(&sc->sc_lock);
+	kfree(sc->sc_name);
+	kfree(sc);
+}
+
+void *
+slab_alloc(struct slab_cache *sc)
+{
+	struct slab *sl, *newsl;
+	void *obj;
+
+	spinlock_acquire(&sc->sc_lock);
+	while (1) {
+		sl = sc->sc_partial != NULL ? sc->sc_partial : sc->sc_empty;
+		if (sl != NULL) {
+			break;
+		}
+
+		/* Out of objects: make a new slab. */
+		spinlock_release(&sc->sc_lock);
+		newsl = slab_create(sc);
+		if (newsl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&sc->sc_lock);
+		slab_listadd(&sc->sc_empty, newsl);
+		sc->sc_nempty++;
+		sc->sc_nslabs++;
+		sc->sc_grows++;
+	}
+
+	KASSERT(sl->sl_nfree > 0);
+	obj = slab_obj(sc, sl, sl->sl_free[--sl->sl_nfree]);
+	sl->sl_inuse++;
+	slab_move(sc, sl, sl->sl_nfree == 0 ? &sc->sc_full : &sc->sc_partial);
+	sc->sc_inuse++;
+	sc->sc_allocs++;
+
+	spinlock_release(&sc->sc_lock);
+	return obj;
+}
+
+void
+slab_free(struct slab_cache *sc, void *obj)
+{
+	struct slab *sl, *victim = NULL;
+	size_t off;
+
+	sl = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(sl->sl_cache == sc);
+	off = (char *)obj - (char *)sl - sc->sc_objoff;
+	KASSERT(off % sc->sc_objsize == 0);
+	KASSERT(off / sc->sc_objsize < sc->sc_perslab);
+
+	spinlock_acquire(&sc->sc_lock);
+
+	KASSERT(sl->sl_inuse > 0);
+	sl->sl_free[sl->sl_nfree++] = off / sc->sc_objsize;
+	sl->sl_inuse--;
+	slab_move(sc, sl, sl->sl_inuse == 0 ? &sc->sc_empty : &sc->sc_partial);
+	sc->sc_inuse--;
+	sc->sc_frees++;
+
+	/* Too many empty slabs: give one back. */
+	if (sc->sc_nempty > SLAB_MAXEMPTY) {
+		victim = sc->sc_empty;
+		slab_listremove(victim);
+		sc->sc_nempty--;
+		sc->sc_nslabs--;
+		sc->sc_reaps++;
+	}
+
+	spinlock_release(&sc->sc_lock);
+
+	if (victim != NULL) {
+		slab_destroy(sc, victim);
+	}
+}
+
+/*
+ * Print, for each cache, how many of its objects are in use and how
+ * much of its slab memory that is.
+ */
+void
+slab_printstats(void)
+{
+	struct slab_cache *sc;
+	unsigned nslabs, inuse, total;
+	uint32_t allocs, frees, grows, reaps;
+
+	spinlock_acquire(&slab_cacheslock);
+	for (sc = slab_caches; sc != NULL; sc = sc->sc_next) {
+		spinlock_acquire(&sc->sc_lock);
+		nslabs = sc->sc_nslabs;
+		inuse = sc->sc_inuse;
+		allocs = sc->sc_allocs;
+		frees = sc->sc_frees;
+		grows = sc->sc_grows;
+		reaps = sc->sc_reaps;
+		spinlock_release(&sc->sc_lock);
+
+		total = nslabs * sc->sc_perslab;
+		kprintf("slab %s: %zu bytes, %u slabs, %u/%u objects in use "
+			"(%u%%), %u%% of slab memory\n",
+			sc->sc_name, sc->sc_objsize, nslabs, inuse, total,
+			total ? inuse * 100 / total : 0,
+			nslabs ? (unsigned)((uint64_t)inuse * sc->sc_objsize *
+					    100 / (nslabs * PAGE_SIZE)) : 0);
+		kprintf("slab %s: %u allocs, %u frees, %u slabs created, "
+			"%u destroyed\n",
+			sc->sc_name, allocs, frees, grows, reaps);
+	}
+	spinlock_release(&slab_cacheslock);
+}
@@ -0,0 +1,389 @@
+#include "swapcache.h"
+
+/**
+ * Compressed page format (LZ77 style):
+ *  - literal run: one byte 0x00-0x7f (length-1, 1 to 128 bytes), followed by the literal bytes
+ *  - match: one byte 0x80-0xff (length-3, 3 to 130 bytes), followed by the 16 bit distance (big endian)
+ *    of the previous occurrence of the bytes. Match and data may overlap (e.g. runs of zeros).
+*/
+#define LZ_MAX_LITERALS 128
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH+127)
+
+static struct swapCache *sc;
+
+/**
+ * Hash of the 3 bytes starting at p.
+*/
+static unsigned lzHash(const uint8_t *p){
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (SWAP_CACHE_HASH_SIZE - 1);
+}
+
+/**
+ * Emits a run of literals.
+ *
+ * @return new output position, -1 if it doesn't fit in the output buffer
+*/
+static int lzLiterals(const uint8_t *src, int len, uint8_t *dst, int op, int dstmax){
+    int n;
+
+    while(len>0){
+        n = len > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : len;
+        if(op+1+n > dstmax){
+            return -1;
+        }
+        dst[op++] = (uint8_t)(n-1);
+        memcpy(dst+op, src, n);
+        op += n;
+        src += n;
+        len -= n;
+    }
+    return op;
+}
+
+/**
+ * Compresses a page, using the hash table of a work area.
+ *
+ * @return size of the compressed page, -1 if it is larger than dstmax
+*/
+static int lzCompress(uint16_t *hashTable, const uint8_t *src, int len, uint8_t *dst, int dstmax){
+    int ip = 0, op = 0, literals = 0;
+    int ref, mlen;
+    unsigned h;
+
+    // Positions are stored +1, so that 0 means "no previous occurrence"
+    bzero(hashTable, SWAP_CACHE_HASH_SIZE*sizeof(uint16_t));
+
+    while(ip + LZ_MIN_MATCH <= len){
+        h = lzHash(src+ip);
+        ref = (int)hashTable[h] - 1;
+        hashTable[h] = (uint16_t)(ip+1);
+
+        if(ref>=0 && src[ref]==src[ip] && src[ref+1]==src[ip+1] && src[ref+2]==src[ip+2]){
+            op = lzLiterals(src+literals, ip-literals, dst, op, dstmax);
+            if(op<0 || op+3 > dstmax){
+                return -1;
+            }
+
+            mlen = LZ_MIN_MATCH;
+            while(ip+mlen < len && mlen < LZ_MAX_MATCH && src[ref+mlen]==src[ip+mlen]){
+                mlen++;
+            }
+
+            dst[op++] = (uint8_t)(0x80 | (mlen-LZ_MIN_MATCH));
+            dst[op++] = (uint8_t)((ip-ref) >> 8);
+            dst[op++] = (uint8_t)((ip-ref) & 0xff);
+            ip += mlen;
+            literals = ip;
+        }
+        else{
+            ip++;
+        }
+    }
+
+    return lzLiterals(src+literals, len-literals, dst, op, dstmax);
+}
+
+/**
+ * Decompresses a page.
+ *
+ * @return 0 on success, -1 if the compressed data is corrupted
+*/
+static int lzDecompress(const uint8_t *src, int slen, uint8_t *dst, int dlen){
+    int ip = 0, op = 0, n, dist;
+
+    while(ip < slen){
+        if(src[ip] & 0x80){
+            if(ip+3 > slen){
+                return -1;
+            }
+            n = (src[ip] & 0x7f) + LZ_MIN_MATCH;
+            dist = (src[ip+1] << 8) | src[ip+2];
+            ip += 3;
+            if(dist==0 || dist>op || op+n > dlen){
+                return -1;
+            }
+            while(n-- > 0){ // byte by byte, source and destination may overlap
+                dst[op] = dst[op-dist];
+                op++;
+            }
+        }
+        else{
+            n = src[ip++] + 1;
+            if(ip+n > slen || op+n > dlen){
+                return -1;
+            }
+            memcpy(dst+op, src+ip, n);
+            ip += n;
+            op += n;
+        }
+    }
+
+    return op==dlen ? 0 : -1;
+}
+
+/**
+ * Allocates n contiguous chunks in one of the frames of the pool (first fit).
+ * Must be called holding sc->cacheLock.
+ *
+ * @return 0 on success (frame and first chunk are stored in the entry), -1 if the pool is full
+*/
+static int allocChunks(struct swapCacheEntry *e, int n){
+    int f, c;
+    uint32_t mask;
+
+    KASSERT(n>0 && n<SWAP_CACHE_CHUNKS);
+    mask = ((uint32_t)1 << n) - 1;
+
+    for(f=0;f<SWAP_CACHE_FRAMES;f++){
+        for(c=0;c+n<=SWAP_CACHE_CHUNKS;c++){
+            if((sc->usedMask[f] & (mask << c))==0){
+                sc->usedMask[f] |= mask << c;
+                e->frame = f;
+                e->firstChunk = c;
+                e->nChunks = n;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the address of the compressed page of an entry.
+*/
+static void *entryData(struct swapCacheEntry *e){
+    return (char *)sc->frames[e->frame] + e->firstChunk*SWAP_CACHE_CHUNK;
+}
+
+/**
+ * Takes a free work area, waiting if they are all in use.
+*/
+static int getWork(void){
+    int w;
+
+    P(sc->workSem);
+    spinlock_acquire(&sc->cacheLock);
+    for(w=0; (sc->workFree & ((uint32_t)1 << w))==0; w++){
+        KASSERT(w<SWAP_CACHE_WORKERS-1);
+    }
+    sc->workFree &= ~((uint32_t)1 << w);
+    spinlock_release(&sc->cacheLock);
+    return w;
+}
+
+/**
+ * Gives back a work area taken with getWork.
+*/
+static void putWork(int w){
+    spinlock_acquire(&sc->cacheLock);
+    sc->workFree |= (uint32_t)1 << w;
+    spinlock_release(&sc->cacheLock);
+    V(sc->workSem);
+}
+
+/**
+ * This function sets up the compressed swap cache, allocating the frames of the pool.
+*/
+void initSwapCache(void){
+    int i;
+
+    sc = kmalloc(sizeof(struct swapCache));
+    if(!sc){
+        panic("Fatal error: failed to allocate the swap cache");
+    }
+
+    for(i=0;i<SWAP_CACHE_FRAMES;i++){
+        sc->frames[i] = kmalloc(PAGE_SIZE); //kmalloc pages are never chosen as victims
+        if(!sc->frames[i]){
+            panic("Fatal error: failed to allocate the swap cache frames");
+        }
+        sc->usedMask[i] = 0;
+    }
+
+    for(i=0;i<SWAP_CACHE_ENTRIES;i++){
+        sc->entries[i].frame = -1;
+    }
+
+    for(i=0;i<SWAP_CACHE_WORKERS;i++){
+        sc->work[i] = kmalloc(sizeof(struct swapCacheWork));
+        if(!sc->work[i]){
+            panic("Fatal error: failed to allocate the swap cache work areas");
+        }
+    }
+    sc->workFree = ((uint32_t)1 << SWAP_CACHE_WORKERS) - 1;
+    sc->workSem = sem_create("swapcache_work", SWAP_CACHE_WORKERS);
+    if(!sc->workSem){
+        panic("Fatal error: failed to create the swap cache semaphore");
+    }
+
+    spinlock_init(&sc->cacheLock);
+    spinlock_init(&sc->statsLock);
+    sc->stores = 0;
+    sc->storesCached = 0;
+    sc->rejectedSize = 0;
+    sc->rejectedFull = 0;
+    sc->loads = 0;
+    sc->hits = 0;
+    sc->bytesIn = 0;
+    sc->bytesOut = 0;
+}
+
+/**
+ * This function compresses a page and stores it in the cache. It may sleep waiting for a work area.
+ *
+ * @param int: cache entry that will hold the page
+ * @param const void *: kernel address of the page
+ *
+ * @return 0 if the page was cached, -1 if it compresses badly or the pool is full
+*/
+int swapCacheStore(int entry, const void *page){
+    struct swapCacheEntry *e = &sc->entries[entry];
+    struct swapCacheWork *work;
+    int csize, result, w;
+
+    KASSERT(entry>=0 && entry<SWAP_CACHE_ENTRIES);
+    KASSERT(e->frame==-1);
+
+    //the page is compressed without holding cacheLock, so other CPUs (and interrupts) are not held up
+    w = getWork();
+    work = sc->work[w];
+
+    csize = lzCompress(work->hashTable, page, PAGE_SIZE, work->cbuf, SWAP_CACHE_MAX_CSIZE);
+    if(csize<0){
+        result = -1;
+    }
+    else{
+        spinlock_acquire(&sc->cacheLock);
+        result = allocChunks(e, DIVROUNDUP(csize, SWAP_CACHE_CHUNK));
+        if(result==0){
+            e->csize = csize;
+            memcpy(entryData(e), work->cbuf, csize);
+        }
+        spinlock_release(&sc->cacheLock);
+    }
+
+    putWork(w);
+
+    spinlock_acquire(&sc->statsLock);
+    sc->stores++;
+    if(csize<0){
+        sc->rejectedSize++;
+    }
+    else if(result){
+        sc->rejectedFull++;
+    }
+    else{
+        sc->storesCached++;
+        sc->bytesIn += PAGE_SIZE;
+        sc->bytesOut += csize;
+    }
+    spinlock_release(&sc->statsLock);
+
+    DEBUG(DB_SWAP,"Swap cache store in entry %d: %d bytes%s\n", entry, csize, result ? " (rejected)" : "");
+
+    return result;
+}
+
+/**
+ * This function decompresses a page from the cache. The entry remains valid.
+ * No lock is needed: the chunks of the entry are only changed by its owner (the caller).
+ *
+ * @param int: cache entry holding the page
+ * @param void *: kernel address of the destination page
+*/
+void swapCacheLoad(int entry, void *page){
+    struct swapCacheEntry *e = &sc->entries[entry];
+
+    KASSERT(entry>=0 && entry<SWAP_CACHE_ENTRIES);
+    KASSERT(e->frame!=-1);
+
+    if(lzDecompress(entryData(e), e->csize, page, PAGE_SIZE)){
+        panic("Fatal error: corrupted page in the swap cache (entry %d)", entry);
+    }
+}
+
+/**
+ * This function copies a cached page into another entry, without decompressing it (used by fork).
+ *
+ * @param int: destination cache entry
+ * @param int: source cache entry
+ *
+ * @return 0 on success, -1 if the pool is full
+*/
+int swapCacheCopy(int dst, int src){
+    struct swapCacheEntry *d = &sc->entries[dst];
+    struct swapCacheEntry *s = &sc->entries[src];
+    int result;
+
+    KASSERT(d->frame==-1);
+    KASSERT(s->frame!=-1);
+
+    spinlock_acquire(&sc->cacheLock);
+    result = allocChunks(d, s->nChunks);
+    if(result==0){
+        d->csize = s->csize;
+        memcpy(entryData(d), entryData(s), s->csize);
+    }
+    spinlock_release(&sc->cacheLock);
+
+    return result;
+}
+
+/**
+ * This function releases the space used by a cache entry.
+ *
+ * @param int: cache entry
+*/
+void swapCacheFree(int entry){
+    struct swapCacheEntry *e = &sc->entries[entry];
+
+    KASSERT(entry>=0 && entry<SWAP_CACHE_ENTRIES);
+    KASSERT(e->frame!=-1);
+
+    spinlock_acquire(&sc->cacheLock);
+    sc->usedMask[e->frame] &= ~((((uint32_t)1 << e->nChunks) - 1) << e->firstChunk);
+    e->frame = -1;
+    spinlock_release(&sc->cacheLock);
+}
+
+/**
+ * Records a page read back from the swap area (hit = 1 if it was found in the cache).
+*/
+void swapCacheCountLoad(int hit){
+    spinlock_acquire(&sc->statsLock);
+    sc->loads++;
+    if(hit){
+        sc->hits++;
+    }
+    spinlock_release(&sc->statsLock);
+}
+
+/**
+ * Prints hit rate, compression ratio and the disk I/O avoided by the cache.
+*/
+void printSwapCacheStatistics(void){
+    uint32_t stores, cached, rejSize, rejFull, loads, hits;
+    uint64_t in, out;
+
+    spinlock_acquire(&sc->statsLock);
+    stores = sc->stores;
+    cached = sc->storesCached;
+    rejSize = sc->rejectedSize;
+    rejFull = sc->rejectedFull;
+    loads = sc->loads;
+    hits = sc->hits;
+    in = sc->bytesIn;
+    out = sc->bytesOut;
+    spinlock_release(&sc->statsLock);
+
+    kprintf("Swap cache statistics:\n"
+            "\tPages stored = %d out of %d (rejected: %d compress badly, %d pool full)\n"
+            "\tHits = %d out of %d swap loads (%d%%)\n"
+            "\tCompression ratio = %d.%02d\n"
+            "\tDisk I/O avoided = %d pages (%d writes, %d reads)\n\n",
+            cached, stores, rejSize, rejFull,
+            hits, loads, loads ? (int)(hits*100ULL/loads) : 0,
+            out ? (int)(in/out) : 0, out ? (int)((in*100/out)%100) : 0,
+            cached+hits, cached, hits);
+}
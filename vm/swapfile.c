@@ -1,105 +1,590 @@
 #include "swapfile.h"
 
-#define MAX_SIZE 9*1024*1024 //Size of the swap file (9 MB)
+#define SLOT_TO_OFFSET(dev,slot) ((off_t)((slot)-(dev)->firstSlot)*PAGE_SIZE) //Position of a slot within its swap device
+#define IS_CACHE_SLOT(slot) ((slot) >= sf->sizeSF && (slot) < sf->sizeSF + SWAP_CACHE_ENTRIES) //RAM slot, held by the swap cache
+#define SLOT_TO_CACHE(slot) ((slot) - sf->sizeSF) //Swap cache entry of a RAM slot
+#define FIRST_ZERO_SLOT (sf->sizeSF + SWAP_CACHE_ENTRIES) //First zero entry
+#define IS_ZERO_SLOT(slot) ((slot) >= FIRST_ZERO_SLOT) //Zero entry: all-zero page, nothing is stored
+#define TOTAL_SLOTS (FIRST_ZERO_SLOT + SWAP_ZERO_ENTRIES) //Number of slot descriptors
+#define SWAP_PAGES_PER_CHUNK (PAGE_SIZE / sizeof(struct swapPage)) //Slot descriptors in each page-sized chunk of sf->pages
+#define SLOT_PAGE(slot) (&sf->pages[(slot) / SWAP_PAGES_PER_CHUNK][(slot) % SWAP_PAGES_PER_CHUNK]) //Descriptor of a slot
+#define SLOT_TO_IOBUCKET(slot) (&sf->ioBuckets[(slot) & (SWAP_IO_BUCKETS-1)]) //Bucket of the writes in progress on a slot
 
 struct swapFile *sf;
 
+/**
+ * Hash function of the swap map. Pages of the same process with consecutive
+ * virtual page numbers end up in consecutive buckets.
+ *
+ * @param pid_t: process ID
+ * @param vaddr_t: virtual address of the page
+ *
+ * @return bucket index
+*/
+static int swapMapHash(pid_t pid, vaddr_t vaddr){
+    return (int)(((vaddr / PAGE_SIZE) ^ ((unsigned)pid << 4)) & sf->mapMask);
+}
+
+/**
+ * Looks up the slot holding the page (pid, vaddr).
+ *
+ * @return slot number, SWAP_NONE if the page is not in the swap file
+*/
+static int swapMapLookup(pid_t pid, vaddr_t vaddr){
+    int slot;
+
+    for(slot=sf->swapMap[swapMapHash(pid,vaddr)]; slot!=SWAP_NONE; slot=SLOT_PAGE(slot)->next){
+        if(SLOT_PAGE(slot)->pid==pid && SLOT_PAGE(slot)->vaddr==vaddr){
+            return slot;
+        }
+    }
+    return SWAP_NONE;
+}
+
+/**
+ * Inserts a slot (whose pid and vaddr are already set) in the swap map and in the chain of its process.
+*/
+static void swapMapInsert(int slot){
+    struct swapPage *page = SLOT_PAGE(slot);
+    int bucket = swapMapHash(page->pid, page->vaddr);
+
+    page->next = sf->swapMap[bucket];
+    sf->swapMap[bucket] = slot;
+
+    page->procPrev = SWAP_NONE;
+    page->procNext = sf->procPages[page->pid];
+    if(page->procNext!=SWAP_NONE){
+        SLOT_PAGE(page->procNext)->procPrev = slot;
+    }
+    sf->procPages[page->pid] = slot;
+}
+
+/**
+ * Removes a slot from the swap map and from the chain of its process.
+ * Buckets are short, so the walk of the bucket chain is constant time on average.
+*/
+static void swapMapRemove(int slot){
+    struct swapPage *page = SLOT_PAGE(slot);
+    int *link = &sf->swapMap[swapMapHash(page->pid, page->vaddr)];
+
+    while(*link!=slot){
+        KASSERT(*link!=SWAP_NONE);
+        link = &SLOT_PAGE(*link)->next;
+    }
+    *link = page->next;
+
+    if(page->procPrev!=SWAP_NONE){
+        SLOT_PAGE(page->procPrev)->procNext = page->procNext;
+    }
+    else{
+        KASSERT(sf->procPages[page->pid]==slot);
+        sf->procPages[page->pid] = page->procNext;
+    }
+    if(page->procNext!=SWAP_NONE){
+        SLOT_PAGE(page->procNext)->procPrev = page->procPrev;
+    }
+}
+
+/**
+ * Returns the device holding a slot.
+*/
+static struct swapDevice *slotDevice(int slot){
+    int i;
+
+    for(i=0;i<sf->nDevices;i++){
+        if(slot>=sf->devices[i].firstSlot && slot<sf->devices[i].firstSlot+sf->devices[i].nSlots){
+            return &sf->devices[i];
+        }
+    }
+    panic("Swap slot %d does not belong to any device\n", slot);
+}
+
+/**
+ * Allocates a free slot. Consecutive allocations are interleaved across the swap devices,
+ * so that independent disks can serve swap I/O concurrently; on each device the slot with
+ * the lowest offset is chosen. Panics if all the devices are full.
+*/
+static int allocSwapSlot(void){
+    unsigned slot;
+    int i;
+    struct swapDevice *dev;
+
+    for(i=0;i<sf->nDevices;i++){
+        dev = &sf->devices[sf->nextDevice];
+        sf->nextDevice = (sf->nextDevice+1) % sf->nDevices;
+        if(!bitmap_alloc(dev->freeMap, &slot)){
+            slot += dev->firstSlot;
+            return (int)slot;
+        }
+    }
+
+    if(sf->nDevices==0){
+        panic("Out of memory: no swap device (boot with %s=<device>)", SWAP_DEVICES_ARG);
+    }
+    panic("The swapfile is full!"); //no free slot is available -> the swapfile is full
+}
+
+/**
+ * Allocates a RAM slot, whose page will be held by the swap cache.
+ *
+ * @return slot number, SWAP_NONE if all the entries of the cache are in use
+*/
+static int allocCacheSlot(void){
+    unsigned entry;
+
+    if(bitmap_alloc(sf->cacheMap, &entry)){
+        return SWAP_NONE;
+    }
+    return sf->sizeSF + (int)entry;
+}
+
+/**
+ * Allocates a zero entry, used to record an all-zero page.
+ *
+ * @return slot number, SWAP_NONE if all the zero entries are in use
+*/
+static int allocZeroSlot(void){
+    unsigned entry;
+
+    if(bitmap_alloc(sf->zeroMap, &entry)){
+        return SWAP_NONE;
+    }
+    return FIRST_ZERO_SLOT + (int)entry;
+}
+
+/**
+ * Checks whether a page contains only zeros, scanning it one word at a time.
+ *
+ * @param const void *: kernel address of the page
+ *
+ * @return 1 if the page is all zeros, 0 otherwise
+*/
+static int pageIsZero(const void *kaddr){
+    const uint32_t *w = kaddr;
+    unsigned i;
+
+    for(i=0; i<PAGE_SIZE/sizeof(uint32_t); i+=4){
+        if((w[i] | w[i+1] | w[i+2] | w[i+3]) != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Gives a slot back to the allocator. For RAM slots, the compressed page is released as well.
+*/
+static void releaseSwapSlot(int slot){
+    struct swapDevice *dev;
+
+    SLOT_PAGE(slot)->vaddr = 0;
+    SLOT_PAGE(slot)->pid = 0;
+
+    if(IS_ZERO_SLOT(slot)){
+        bitmap_unmark(sf->zeroMap, slot - FIRST_ZERO_SLOT);
+        return;
+    }
+
+    if(IS_CACHE_SLOT(slot)){
+        swapCacheFree(SLOT_TO_CACHE(slot));
+        bitmap_unmark(sf->cacheMap, SLOT_TO_CACHE(slot));
+        return;
+    }
+
+    dev = slotDevice(slot);
+    bitmap_unmark(dev->freeMap, slot-dev->firstSlot);
+}
+
+/**
+ * Completion callback of the disk scheduler: updates the counters of the device,
+ * removes a write from its bucket of in-flight writes and wakes up the processes waiting on the bucket.
+ * Called from the interrupt handler of the device.
+*/
+static void swapIODone(struct diskreq *dreq, void *arg){
+    struct swapIORequest *r = arg, **link;
+    struct swapIOBucket *b;
+    struct timespec now, duration;
+
+    (void)dreq;
+
+    gettime(&now);
+    timespec_sub(&now, &r->start, &duration);
+
+    spinlock_acquire(&r->dev->statsLock);
+    if(r->req.dr_write){
+        r->dev->pagesWritten++;
+    }
+    else{
+        r->dev->pagesRead++;
+    }
+    timespec_add(&r->dev->ioTime, &duration, &r->dev->ioTime);
+    spinlock_release(&r->dev->statsLock);
+
+    if(r->req.dr_write){
+        b = SLOT_TO_IOBUCKET(r->slot);
+        spinlock_acquire(&b->lock);
+        for(link=&b->inflight; *link!=r; link=&(*link)->next){
+            KASSERT(*link!=NULL);
+        }
+        *link = r->next;
+        wchan_wakeall(b->wchan, &b->lock);
+        spinlock_release(&b->lock);
+    }
+
+    if(r->callback){
+        r->callback(r, r->arg);
+    }
+}
+
+/**
+ * This function starts the transfer of a page between memory and a swap slot, without waiting for it.
+ * Until the transfer of a write completes, loads of the slot wait for it.
+ *
+ * @param struct swapIORequest *: request, it must stay allocated until it completes
+ * @param int: swap slot (stored on a device)
+ * @param void *: kernel address of the page
+ * @param enum uio_rw: UIO_READ to load the page from the slot, UIO_WRITE to store it
+ * @param callback: function called on completion (from the interrupt handler, it must not sleep), may be NULL
+ * @param void *: argument of the callback
+*/
+void swapIOSubmit(struct swapIORequest *r, int slot, void *kaddr, enum uio_rw rw,
+                  void (*callback)(struct swapIORequest *, void *), void *arg){
+    struct swapDevice *dev = slotDevice(slot);
+    uint32_t blocksPerPage = PAGE_SIZE / dev->sched->ds_blocksize;
+    struct swapIOBucket *b;
+
+    r->dev = dev;
+    r->slot = slot;
+    r->callback = callback;
+    r->arg = arg;
+    r->req.dr_buf = kaddr;
+    r->req.dr_block = (slot - dev->firstSlot) * blocksPerPage;
+    r->req.dr_nblocks = blocksPerPage;
+    r->req.dr_write = (rw==UIO_WRITE);
+    r->req.dr_callback = swapIODone;
+    r->req.dr_cbarg = r;
+    gettime(&r->start);
+
+    if(rw==UIO_WRITE){
+        //the write is tracked before it is started, so that it can't complete before being in the list
+        b = SLOT_TO_IOBUCKET(slot);
+        spinlock_acquire(&b->lock);
+        r->next = b->inflight;
+        b->inflight = r;
+        spinlock_release(&b->lock);
+    }
+
+    disksched_start(dev->sched, &r->req);
+}
+
+/**
+ * This function waits for the completion of a transfer started with swapIOSubmit.
+ *
+ * @param struct swapIORequest *: request
+ *
+ * @return 0 on success, the error code of the device otherwise
+*/
+int swapIOWait(struct swapIORequest *r){
+    return disksched_wait(r->dev->sched, &r->req);
+}
+
+/**
+ * Transfers a page between memory and a swap slot, waiting for the transfer to complete.
+ *
+ * @return 0 on success, the error code of the device otherwise
+*/
+static int swapIO(int slot, void *kaddr, enum uio_rw rw){
+    struct swapIORequest r;
+
+    swapIOSubmit(&r, slot, kaddr, rw, NULL, NULL);
+    return swapIOWait(&r);
+}
+
+/**
+ * Waits until there is no write in progress on the slot.
+*/
+static void waitSlotWrite(int slot){
+    struct swapIOBucket *b = SLOT_TO_IOBUCKET(slot);
+    struct swapIORequest *r;
+
+    spinlock_acquire(&b->lock);
+    r = b->inflight;
+    while(r!=NULL){
+        if(r->slot==slot){
+            wchan_sleep(b->wchan, &b->lock);
+            r = b->inflight; //the bucket has changed: start over
+        }
+        else{
+            r = r->next;
+        }
+    }
+    spinlock_release(&b->lock);
+}
+
 #if OPT_DEBUG
 /**
- * Given the process ID, it prints the text, data, and stack lists.
+ * Given the process ID, it prints the pages it owns in the swap file.
  * @param pid_t: process ID of the target process.
 */
 void printPageLists(pid_t pid){
-    struct swapPage *i;
+    int slot;
 
     kprintf("\tSWAP PAGE LIST FOR PROCESS %d:\n",pid);
-    kprintf("Text:\n");
-    for(i=sf->textPages[pid];i!=NULL;i=i->next){
-        kprintf("addr: 0x%x, offset: 0x%x, next: 0x%x\n",i->vaddr,i->swapOffset,(unsigned int)i->next);
-    }
-    kprintf("Data:\n");
-    for(i=sf->dataPages[pid];i!=NULL;i=i->next){
-        kprintf("addr: 0x%x, offset: 0x%x, next: 0x%x\n",i->vaddr,i->swapOffset,(unsigned int)i->next);
-    }
-    kprintf("Stack:\n");
-    for(i=sf->stackPages[pid];i!=NULL;i=i->next){
-        kprintf("addr: 0x%x, offset: 0x%x, next: 0x%x\n",i->vaddr,i->swapOffset,(unsigned int)i->next);
+    for(slot=sf->procPages[pid];slot!=SWAP_NONE;slot=SLOT_PAGE(slot)->procNext){
+        if(IS_ZERO_SLOT(slot)){
+            kprintf("addr: 0x%x, zero page, next: %d\n",SLOT_PAGE(slot)->vaddr,SLOT_PAGE(slot)->procNext);
+        }
+        else if(IS_CACHE_SLOT(slot)){
+            kprintf("addr: 0x%x, swap cache entry: %d, next: %d\n",SLOT_PAGE(slot)->vaddr,SLOT_TO_CACHE(slot),SLOT_PAGE(slot)->procNext);
+        }
+        else{
+            kprintf("addr: 0x%x, device: %s, offset: 0x%x, next: %d\n",SLOT_PAGE(slot)->vaddr,slotDevice(slot)->name,(unsigned int)SLOT_TO_OFFSET(slotDevice(slot),slot),SLOT_PAGE(slot)->procNext);
+        }
     }
     kprintf("\n");
 }
 #endif
 
 /**
- * This function sets up the swap file. Specifically, it allocates the necessary data structures and opens the file that will hold the pages.
+ * Parses the SWAP_SIZE_ARG boot option: a number of bytes, optionally followed by K or M.
+ *
+ * @return size in bytes, 0 (no bound) if the option is missing or not valid
 */
-int initSwapfile(void){
+static off_t parseSwapSize(const char *arg){
+    off_t size = 0;
+
+    if(arg==NULL){
+        return 0;
+    }
+
+    for(; *arg>='0' && *arg<='9'; arg++){
+        size = size*10 + (*arg-'0');
+    }
+    if(*arg=='k' || *arg=='K'){
+        size *= 1024;
+        arg++;
+    }
+    else if(*arg=='m' || *arg=='M'){
+        size *= 1024*1024;
+        arg++;
+    }
+
+    if(*arg!=0){
+        kprintf("swap: invalid %s, using the whole devices\n", SWAP_SIZE_ARG);
+        return 0;
+    }
+    return size;
+}
+
+/**
+ * Claims a swap device and computes how many slots it can hold.
+ * The device is taken with vfs_swapon, so it can't be mounted while it holds the swap area.
+ *
+ * @param const char *: device name (e.g. lhd1)
+ * @param off_t: upper bound of the swap area on the device, 0 to use the whole device
+ *
+ * @return 0 on success, an error code otherwise (the device is released)
+*/
+static int openSwapDevice(const char *name, off_t maxSize, struct swapDevice *dev){
+    struct stat st;
+    off_t size;
     int result;
-    int i;
-    char fname[9];
-    struct swapPage *page;
 
-    strcpy(fname,"lhd0raw:"); // lhd0raw for swapfile
+    strcpy(dev->name, name);
+
+    result = vfs_swapon(name, &dev->v); //fails with EBUSY if a file system is mounted on the device
+    if(result){
+        return result;
+    }
+
+    result = VOP_STAT(dev->v, &st);
+    if(result){
+        goto fail;
+    }
+
+    size = st.st_size;
+    if(maxSize > 0 && size > maxSize){
+        size = maxSize;
+    }
+
+    dev->nSlots = size/PAGE_SIZE;
+    if(dev->nSlots==0){
+        result = ENOSPC;
+        goto fail;
+    }
+
+    // Swap I/O is queued directly on the device, so it must be a block device with a request queue
+    dev->sched = dev_getsched(dev->v);
+    if(!dev->sched || PAGE_SIZE % dev->sched->ds_blocksize != 0){
+        result = ENODEV;
+        goto fail;
+    }
+
+    dev->freeMap = bitmap_create(dev->nSlots); // All slots are free: bitmap_create clears every bit
+    if(!dev->freeMap){
+        panic("Fatal error: failed to allocate the swap bitmaps");
+    }
+
+    spinlock_init(&dev->statsLock);
+    dev->pagesRead = 0;
+    dev->pagesWritten = 0;
+    dev->ioTime.tv_sec = 0;
+    dev->ioTime.tv_nsec = 0;
+    return 0;
+
+fail:
+    VOP_DECREF(dev->v);
+    vfs_swapoff(name);
+    return result;
+}
+
+/**
+ * Claims the devices listed (comma separated) in the SWAP_DEVICES_ARG boot option.
+ * Slots are numbered consecutively across them. Swapping is opt-in: without the option
+ * no device is touched, and only the swap cache and the zero entries are available.
+*/
+static void openSwapDevices(void){
+    const char *names = bootarg_get(SWAP_DEVICES_ARG);
+    off_t maxSize = parseSwapSize(bootarg_get(SWAP_SIZE_ARG));
+    char name[sizeof(sf->devices[0].name)];
+    struct swapDevice *dev;
+    size_t len;
+    int result;
+
+    if(names==NULL){
+        kprintf("swap: no swap device (boot with %s=<device> to enable it)\n", SWAP_DEVICES_ARG);
+        return;
+    }
+
+    while(*names!=0){
+        for(len=0; names[len]!=0 && names[len]!=','; len++);
+
+        if(len>0 && names[len-1]==':'){
+            len--; //tolerate lhd1: as well as lhd1
+        }
+        if(len==0 || len>=sizeof(name)){
+            kprintf("swap: invalid device name in %s\n", SWAP_DEVICES_ARG);
+        }
+        else if(sf->nDevices==SWAP_MAX_DEVICES){
+            kprintf("swap: too many devices, at most %d are used\n", SWAP_MAX_DEVICES);
+            return;
+        }
+        else{
+            memcpy(name, names, len);
+            name[len] = 0;
+
+            dev = &sf->devices[sf->nDevices];
+            result = openSwapDevice(name, maxSize, dev);
+            if(result){
+                kprintf("swap: can't use %s: %s\n", name, strerror(result));
+            }
+            else{
+                dev->firstSlot = sf->sizeSF;
+                sf->sizeSF += dev->nSlots; //#Pages in the swap file
+                sf->nDevices++;
+                kprintf("swap: using %s, %d pages\n", dev->name, dev->nSlots);
+            }
+        }
+
+        for(names+=len; *names!=0 && *names!=','; names++);
+        if(*names==','){
+            names++;
+        }
+    }
+}
+
+/**
+ * This function sets up the swap file. Specifically, it opens the swap devices and allocates the necessary data structures.
+ * The devices and the size of the swap area on each of them are given by boot options (see openSwapDevices).
+*/
+int initSwapfile(void){
+    int i, nChunks;
+    unsigned nBuckets;
 
     sf = kmalloc(sizeof(struct swapFile)); //swapfile allocation
     if(!sf){
         panic("Fatal error: failed to allocate swap space");
     }
 
-    // Open the swap file
-    result = vfs_open(fname, O_RDWR , 0, &sf->v);
-    if (result) {
-		return result;
-	}
+    sf->nDevices = 0;
+    sf->nextDevice = 0;
+    sf->sizeSF = 0;
+    openSwapDevices();
 
-    sf->sizeSF = MAX_SIZE/PAGE_SIZE; //#Pages in the swap file
+    for(i=0;i<SWAP_COPY_BUFFERS;i++){
+        sf->kbuf[i] = kmalloc(PAGE_SIZE); //Allocating the buffers for copying swap pages (one time allocation)
+        if(!sf->kbuf[i]){
+            panic("Fatal error: failed to allocate kbuf");
+        }
+    }
 
-    sf->kbuf = kmalloc(PAGE_SIZE); //Allocating a buffer for copying swap pages (one time allocation)
-    if(!sf->kbuf){
-        panic("Fatal error: failed to allocate kbuf");
+    sf->copyReqs = kmalloc(SWAP_COPY_BUFFERS*sizeof(struct swapIORequest));
+    if(!sf->copyReqs){
+        panic("Fatal error: failed to allocate the swap copy requests");
     }
 
-    sf->textPages = kmalloc(MAX_PROC*sizeof(struct swapPage *));
-    if(!sf->textPages){
-        panic("Fatal error: failed to allocate text pages");
+    // The swap map has a power of 2 buckets, enough to keep chains of at most SWAP_MAP_LOAD slots on average
+    for(nBuckets=1; nBuckets*SWAP_MAP_LOAD < (unsigned)TOTAL_SLOTS; nBuckets*=2);
+    sf->mapMask = nBuckets - 1;
+    sf->swapMap = kmalloc(nBuckets*sizeof(int));
+    if(!sf->swapMap){
+        panic("Fatal error: failed to allocate the swap map");
     }
 
-    sf->dataPages = kmalloc(MAX_PROC*sizeof(struct swapPage *));
-    if(!sf->dataPages){
-        panic("Fatal error: failed to allocate data pages");
+    sf->procPages = kmalloc((MAX_PROC+1)*sizeof(int)); // pids are in [1, MAX_PROC]
+    if(!sf->procPages){
+        panic("Fatal error: failed to allocate process pages");
     }
 
-    sf->stackPages = kmalloc(MAX_PROC*sizeof(struct swapPage *));
-    if(!sf->stackPages){
-        panic("Fatal error: failed to allocate stack pages");
+    /**
+     * The descriptors are allocated one page at a time: a single array would need
+     * TOTAL_SLOTS*sizeof(struct swapPage) bytes of contiguous memory for a large swap area.
+    */
+    nChunks = DIVROUNDUP(TOTAL_SLOTS, SWAP_PAGES_PER_CHUNK);
+    sf->pages = kmalloc(nChunks*sizeof(struct swapPage *));
+    if(!sf->pages){
+        panic("Fatal error: failed to allocate swap pages");
+    }
+    for(i=0;i<nChunks;i++){
+        sf->pages[i] = kmalloc(PAGE_SIZE);
+        if(!sf->pages[i]){
+            panic("Fatal error: failed to allocate swap pages");
+        }
     }
 
-    // Initialize lists for each process
-    for(i=0;i<MAX_PROC;i++){
-        sf->textPages[i]=NULL;
-        sf->dataPages[i]=NULL;
-        sf->stackPages[i]=NULL;
+    sf->cacheMap = bitmap_create(SWAP_CACHE_ENTRIES);
+    sf->zeroMap = bitmap_create(SWAP_ZERO_ENTRIES);
+    if(!sf->cacheMap || !sf->zeroMap){
+        panic("Fatal error: failed to allocate the swap bitmaps");
     }
 
-    sf->freePages=NULL;
+    for(i=0;i<SWAP_IO_BUCKETS;i++){
+        sf->ioBuckets[i].inflight = NULL;
+        spinlock_init(&sf->ioBuckets[i].lock);
+        sf->ioBuckets[i].wchan = wchan_create("swap_io");
+        if(!sf->ioBuckets[i].wchan){
+            panic("Fatal error: failed to allocate the swap wait channels");
+        }
+    }
 
-    // Initializes all the elements in the free list.
-    // The iteration is done in reverse order to ensure that head insertion
-    // results in smaller offsets for the first free elements.
+    for(i=0;i<(int)nBuckets;i++){
+        sf->swapMap[i]=SWAP_NONE;
+    }
 
-    for(i=(int)(sf->sizeSF-1); i>=0; i--){
-        page=kmalloc(sizeof(struct swapPage));
-        if(!page){
-            panic("Fatal error: failed to allocate swap pages");
-        }
-        page->swapOffset=i*PAGE_SIZE;
-        page->isStoreOp=0;
-        page->operationCV = cv_create("cell_cv");
-        page->operationLock = lock_create("cell_lock");
+    // Initialize chains for each process
+    for(i=0;i<=MAX_PROC;i++){
+        sf->procPages[i]=SWAP_NONE;
+    }
 
-        // Insert the page into the free list
-        page->next=sf->freePages;
-        sf->freePages=page;
+    for(i=0;i<TOTAL_SLOTS;i++){
+        SLOT_PAGE(i)->vaddr=0;
+        SLOT_PAGE(i)->pid=0;
+        SLOT_PAGE(i)->next=SWAP_NONE;
+        SLOT_PAGE(i)->procNext=SWAP_NONE;
+        SLOT_PAGE(i)->procPrev=SWAP_NONE;
     }
+
+    initSwapCache();
     return 0;
 }
 
@@ -109,256 +594,174 @@ int initSwapfile(void){
  * @param vaddr_t: virtual address that triggered the page fault
  * @param pid_t: process ID
  * @param paddr_t: physical address of the RAM frame to be used
- * 
+ *
  * @return 1 if the page was found in the swap file, 0 otherwise
 */
 int loadSwapFrame(vaddr_t vaddr, pid_t pid, paddr_t paddr){
     int result;
-    struct iovec iov; //I/O vector structure for scatter/gather I/O
-    struct uio ku; //UIO structure for kernel I/O operations
+    int slot;
 
     KASSERT(pid==curproc->p_pid); //Asserting if the pid is the same of the one of the current process
 
-    struct addrspace *as=proc_getas();
-    struct swapPage *listPages=NULL;
-    struct swapPage *prevPages=NULL;
-    int segVar=-1;     //It's used for removal from the head but can also be used for debugging
-
-    //Identify the right segment (list will point to the correct entry)
-    if(vaddr>=as->as_vbase1 && vaddr <= as->as_vbase1 + as->as_npages1 * PAGE_SIZE ){   //Text segment
-        listPages = sf->textPages[pid];
-        segVar=0;
+    slot = swapMapLookup(pid, vaddr);
+    if(slot==SWAP_NONE){
+        return 0; //page not in the swapfile
     }
 
-    if(vaddr>=as->as_vbase2 && vaddr <= as->as_vbase2 + as->as_npages2 * PAGE_SIZE ){ //Data segment
-        listPages = sf->dataPages[pid];
-        segVar=1;
-    }
+    /** As a consequence of parallelism we have to follow a specific order in the operations
+     *1: Remove the entry from the swap map, otherwise the old entry could be considered valid
+     *2: I/0 Operation, but with the exception that the entry can't be placed in the free list
+     *3: Give the slot back to the allocator (so after the I/O operation has been completed)
+    **/
 
-    if(vaddr <= USERSTACK && vaddr>as->as_vbase2 + as->as_npages2 * PAGE_SIZE){ //Stack segment
-        listPages = sf->stackPages[pid];
-        segVar=2;
-    }
+    swapMapRemove(slot);
 
-    if(segVar==-1){ //segment is not found
-        panic("Wrong virtual address for load: 0x%x, process=%d\n",vaddr,curproc->p_pid);
-    }
-
-    //Search for the right entry (in the swaplist) to remove 
-    while(listPages!=NULL){
-        if(listPages->vaddr==vaddr){ //Entry found
+    waitSlotWrite(slot); //we have to wait until the entry is not stored
 
-            /** As a consequence of parallelism we have to follow a specific order in the operations
-             *1: Remove the entry from the process list, otherwise the old entry could be considered valid
-             *2: I/0 Operation, but with the exception that the entry can't be placed in the free list
-             *3: Place the entry inside the free list (so after the I/O operation has been completed)
-            **/
-
-            if(prevPages!=NULL){ //If List is not the first entry (head of the list)
-                KASSERT(prevPages->next==listPages);
-                prevPages->next=listPages->next; //Removing the entry from the process list
-            }
-            else{ //Removing from head
-                if(segVar==0){
-                    sf->textPages[pid]=listPages->next;
-                }
-                if(segVar==1){
-                    sf->dataPages[pid]=listPages->next;
-                }
-                if(segVar==2){
-                    sf->stackPages[pid]=listPages->next;
-                }
-            }
+    if(IS_ZERO_SLOT(slot)){
+        //all-zero page: it's served like a new stack page, by zero-filling the frame
+        DEBUG(DB_SWAP,"Loading zero page 0x%x for process %d\n",vaddr, pid);
+        bzero((void*)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+        releaseSwapSlot(slot);
+        incrementStatistics(FAULT_ZEROED);
+        incrementStatistics(FAULT_SWAP_ZERO);
+        return 1;
+    }
 
-            lock_acquire(listPages->operationLock);
-            while(listPages->isStoreOp){//we have to wait until the entry is not stored
-                cv_wait(listPages->operationCV,listPages->operationLock);//waiting on the condition variable of the entry
-            }
-            lock_release(listPages->operationLock);
-            DEBUG(DB_SWAP,"Loading swap of vaddr 0x%x in 0x%x for process %d\n",vaddr, listPages->swapOffset, pid);
-            incrementStatistics(FAULT_DISK);
+    DEBUG(DB_SWAP,"Loading swap of vaddr 0x%x in slot %d for process %d\n",vaddr, slot, pid);
 
-            uio_kinit(&iov,&ku,(void*)PADDR_TO_KVADDR(paddr),PAGE_SIZE,listPages->swapOffset,UIO_READ);          //paddr is the physical address of the frame and it's used in order toa void faults
+    if(IS_CACHE_SLOT(slot)){
+        //the page is in the swap cache: no disk I/O is needed, so it is not counted as a disk fault
+        swapCacheLoad(SLOT_TO_CACHE(slot), (void*)PADDR_TO_KVADDR(paddr));
+        swapCacheCountLoad(1);
+        releaseSwapSlot(slot);
+        incrementStatistics(FAULT_FROM_SWAPCACHE);
+        return 1;
+    }
+    swapCacheCountLoad(0);
+    incrementStatistics(FAULT_DISK);
 
-            result = VOP_READ(sf->v,&ku); //reads the swap page from disk into the physical frame at paddr
-            if(result){
-                panic("Fatal error: VOP_READ for swapfile failed with result=%d",result);
-            }
-            DEBUG(DB_SWAP,"Loading swap of vaddr 0x%x in 0x%x for process %d ended\n",listPages->vaddr, listPages->swapOffset, pid);
+    //reads the swap page from disk into the physical frame at paddr (paddr is the physical address of the frame and it's used in order to avoid faults)
+    result = swapIO(slot, (void*)PADDR_TO_KVADDR(paddr), UIO_READ);
+    if(result){
+        panic("Fatal error: read from swapfile failed with result=%d",result);
+    }
+    DEBUG(DB_SWAP,"Loading swap of vaddr 0x%x in slot %d for process %d ended\n",vaddr, slot, pid);
 
-            // put the entry in the free list
-            listPages->next=sf->freePages;                      
-            sf->freePages=listPages;
-            incrementStatistics(FAULT_FROM_SWAPFILE);               
-            listPages->vaddr=0; //reset the virtual address in the list
+    // give the slot back to the allocator
+    releaseSwapSlot(slot);
+    incrementStatistics(FAULT_FROM_SWAPFILE);
 
-            #if OPT_DEBUG
-            printPageLists(pid);                      
-            #endif
+    #if OPT_DEBUG
+    printPageLists(pid);
+    #endif
 
-            return 1;  //entry found in the swapfile, return 1
-        }
-        
-        //entry not found
-        prevPages=listPages;     // update prev and list
-        listPages=listPages->next;
-        KASSERT(prevPages->next==listPages);
-    }
-    return 0;                                             
+    return 1;  //entry found in the swapfile, return 1
 }
 
 /**
  * This function writes a frame into the swap file.
- * If the swap file size exceeds 9MB, it triggers a kernel panic.
+ * If all the swap devices are full, it triggers a kernel panic.
  *
  * @param vaddr_t: virtual address that triggered the page fault
  * @param pid_t: process ID
  * @param paddr_t: physical address of the RAM frame to be saved
- * 
+ *
  * @return -1 on errors, 0 otherwise
 */
 int storeSwapFrame(vaddr_t vaddr, pid_t pid, paddr_t paddr){
+    struct swapIORequest r;
     int result;
-    struct iovec iov; //I/O vector structure for scatter/gather I/O
-    struct uio ku;    //UIO structure for kernel I/O operations
+    int slot;
 
-    struct addrspace *as = proc_getas(); //current process's address space
-    struct swapPage *free_frame;         //pointer to a free swap frame
-    int valid_address = 0;               //flag to check if the address is valid
+    if (vaddr == 0 || vaddr >= USERSTACK || pid <= 0 || pid > MAX_PROC){
+        panic("Wrong vaddr for store: 0x%x\n", vaddr); //the address doesn't belong to a user process
+    }
 
     /**
-     * Due to parallelism, we must ensure the correct order of operations:
-     * 1. Acquire a free frame from the free list.
-     *    - Do not insert it into the process's swap list before the I/O operation completes.
-     *    - This prevents inconsistencies where the process might attempt to access the swap entry prematurely.
-     * 2. During the store operation, the page cannot be accessed as it contains invalid data.
-     *    - Use the `isStoreOp` flag to indicate an ongoing store operation for the frame.
+     * All-zero pages (e.g. untouched stack or BSS) are only recorded in the swap map:
+     * no slot is allocated and no I/O is performed.
     */
-
-    free_frame = sf->freePages;    //first free frame from the swap's free list
-
-    if (free_frame == NULL){
-        panic("The swapfile is full!"); //no free frame is available -> the swapfile is full
+    if(pageIsZero((void*)PADDR_TO_KVADDR(paddr))){
+        slot = allocZeroSlot();
+        if(slot!=SWAP_NONE){
+            SLOT_PAGE(slot)->vaddr = vaddr;
+            SLOT_PAGE(slot)->pid = pid;
+            swapMapInsert(slot);
+            incrementStatistics(SWAP_ZERO_PAGES);
+            DEBUG(DB_SWAP, "Swap store of zero page 0x%x for process %d\n", vaddr, pid);
+            return 1;
+        }
     }
 
-    KASSERT(free_frame->isStoreOp == 0); //check if the frame is being stored
-    sf->freePages = free_frame->next; //remove the frame from the free list
-
-    // Determine which segment the virtual address belongs to and insert the frame accordingly
-
-    //check if the address is in the TEXT segment
-    if (vaddr >= as->as_vbase1 && vaddr <= as->as_vbase1 + as->as_npages1 * PAGE_SIZE ){
-        free_frame->next = sf->textPages[pid]; // Insert at the head of the text swap list for the process
-        sf->textPages[pid] = free_frame;
-        valid_address = 1;
+    /**
+     * The page is first offered to the swap cache. The RAM slot is published in the swap
+     * map only once the page has been stored, so nobody can find it while it is compressed.
+    */
+    slot = allocCacheSlot();
+    if(slot!=SWAP_NONE){
+        if(swapCacheStore(SLOT_TO_CACHE(slot), (void*)PADDR_TO_KVADDR(paddr))==0){
+            SLOT_PAGE(slot)->vaddr = vaddr;
+            SLOT_PAGE(slot)->pid = pid;
+            swapMapInsert(slot);
+            DEBUG(DB_SWAP, "Swap store in slot %d (virtual: 0x%x) for process %d: swap cache\n", slot, vaddr, pid);
+            return 1;
+        }
+        //the page compresses badly or the pool is full: it spills to the disk
+        bitmap_unmark(sf->cacheMap, SLOT_TO_CACHE(slot));
     }
 
-    // check if the address is in the DATA segment
-    if (vaddr >= as->as_vbase2 && vaddr <= as->as_vbase2 + as->as_npages2 * PAGE_SIZE ){
-        free_frame->next = sf->dataPages[pid]; // Insert at the head of the data swap list for the process
-        sf->dataPages[pid] = free_frame;
-        valid_address = 1;
-    }
+    /**
+     * Due to parallelism, we must ensure the correct order of operations:
+     * 1. Acquire a free slot from the allocator.
+     * 2. During the store operation, the page cannot be accessed as it contains invalid data.
+     *    - The write is tracked in its bucket of sf->ioBuckets from the moment it is submitted.
+     *    - It is submitted before the slot is published in the swap map, so that a process
+     *      finding it there waits for the I/O to complete.
+    */
 
-    //check if the address is in the STACK segment
-    if (vaddr <= USERSTACK && vaddr > as->as_vbase2 + as->as_npages2 * PAGE_SIZE){
-        free_frame->next = sf->stackPages[pid]; // Insert at the head of the stack swap list for the process
-        sf->stackPages[pid] = free_frame;
-        valid_address = 1;
-    }
+    slot = allocSwapSlot();
 
-    if (valid_address == 0){
-        panic("Wrong vaddr for store: 0x%x\n", vaddr); //the address doesn't belong to any segment
-    }
+    SLOT_PAGE(slot)->vaddr = vaddr; //assign the virtual address to the swap slot
+    SLOT_PAGE(slot)->pid = pid;
+    swapIOSubmit(&r, slot, (void*)PADDR_TO_KVADDR(paddr), UIO_WRITE, NULL, NULL); //the slot is being stored
 
-    free_frame->vaddr = vaddr; //assign the virtual address to the swap frame
+    swapMapInsert(slot);
 
-    DEBUG(DB_SWAP, "Swap store in 0x%x (virtual: 0x%x) for process %d started\n", free_frame->swapOffset, free_frame->vaddr, pid);
-    
-    free_frame->isStoreOp = 1; //the frame is being stored
+    DEBUG(DB_SWAP, "Swap store in slot %d (virtual: 0x%x) for process %d started\n", slot, vaddr, pid);
 
-    // Initialize the UIO structure for writing to the swap file
-    uio_kinit(&iov, &ku, (void*)PADDR_TO_KVADDR(paddr), PAGE_SIZE, free_frame->swapOffset, UIO_WRITE);
-    
-    result = VOP_WRITE(sf->v, &ku); // Perform the write operation to the swap file
+    // The frame is reused by the caller as soon as we return, so we wait for the write
+    result = swapIOWait(&r);
     if(result){
-        panic("VOP_WRITE in swapfile failed, with result=%d", result); //write failure
+        panic("Write in swapfile failed, with result=%d", result); //write failure
     }
 
-    free_frame->isStoreOp = 0; //storing ended
-
-    // Synchronize with any processes waiting on this swap frame
-    lock_acquire(free_frame->operationLock);
-    cv_broadcast(free_frame->operationCV, free_frame->operationLock);
-    lock_release(free_frame->operationLock);
+    DEBUG(DB_SWAP, "Swap store in slot %d (virtual: 0x%x) for process %d ended\n", slot, vaddr, pid);
 
-    DEBUG(DB_SWAP, "Swap store in 0x%x (virtual: 0x%x) for process %d ended\n", free_frame->swapOffset, free_frame->vaddr, pid);
-    DEBUG(DB_SWAP, "0x%x added to process %d, that points to 0x%x\n", vaddr, pid, free_frame->next ? free_frame->next->vaddr : 0x0);
+    incrementStatistics(SWAPFILE_WRITES);
+    return 1;
 
-    incrementStatistics(SWAPFILE_WRITES); 
-    return 1; 
-        
 }
 
 /**
  * When a process ends, we free all its pages stored in the swap file.
- * 
+ *
  * @param pid_t: process ID of the terminated process.
 */
 void freeProcessPagesInSwap(pid_t pid){
-    struct swapPage *elem, *next;
-
-    //We iterate on text, data and stack lists because we have to remove all the elements that belong to the ended process
-
-    if(sf->textPages[pid]!=NULL){
-        for(elem=sf->textPages[pid];elem!=NULL;elem=next){
-            lock_acquire(elem->operationLock);
-            while(elem->isStoreOp){                                 //we have to wait if there's a isStoreOp operation on the element
-                cv_wait(elem->operationCV,elem->operationLock);
-            }
-            lock_release(elem->operationLock);
+    int slot;
 
-            next=elem->next;                                    //We save next to correctly initialize elem in the following iteration
-            elem->next=sf->freePages;
-            sf->freePages=elem;
-        }
-        sf->textPages[pid]=NULL;
-    }
-
-    if(sf->dataPages[pid]!=NULL){
-        for(elem=sf->dataPages[pid];elem!=NULL;elem=next){
-            lock_acquire(elem->operationLock);
-            while(elem->isStoreOp){
-                cv_wait(elem->operationCV,elem->operationLock);
-            }
-            lock_release(elem->operationLock);
-
-            next=elem->next;
-            elem->next=sf->freePages;
-            sf->freePages=elem;
-        }
-        sf->dataPages[pid]=NULL;
-    }
-
-    if(sf->stackPages[pid]!=NULL){
-        for(elem=sf->stackPages[pid];elem!=NULL;elem=next){
-            lock_acquire(elem->operationLock);
-            while(elem->isStoreOp){
-                cv_wait(elem->operationCV,elem->operationLock);
-            }
-            lock_release(elem->operationLock);
-
-            next=elem->next;
-            elem->next=sf->freePages;
-            sf->freePages=elem;
-        }
-        sf->stackPages[pid]=NULL;
+    //We walk the chain of the process, so the cost only depends on the number of pages it owns
+    while((slot=sf->procPages[pid])!=SWAP_NONE){
+        waitSlotWrite(slot); //we have to wait if there's a store operation on the element
+        swapMapRemove(slot);
+        releaseSwapSlot(slot);
     }
 }
 
 /**
  * When a fork is executed, we duplicate all the pages of the old process for the new process as well.
- * 
+ *
  * @param pid_t: process ID of the original process.
  * @param pid_t: process ID of the new process.
 */
@@ -366,157 +769,120 @@ void duplicateSwapPages(pid_t new_pid, pid_t old_pid) {
     // Log the start of the fork operation
     DEBUG(DB_SWAP,"Process %d performs a kmalloc to fork %d\n",curproc->p_pid,new_pid);
 
-    struct uio u;                //user I/O structure for I/O operations
-    struct iovec iov;            //I/O vector structure for scatter/gather I/O
     int result;                  //result of I/O
-
-    struct swapPage *ptr, *free = NULL;  //pointers for traversing and allocating swap cells
-
-    // Duplicating the text segment swap entries for the new process
-    if (sf->textPages[old_pid] != NULL) {
-        for (ptr = sf->textPages[old_pid]; ptr != NULL; ptr = ptr->next) {
-            
-            // Fetch a free swap cell from the free list
-            free = sf->freePages;
-            if (free == NULL) {
-                panic("The swapfile is full!");  //no free swap cells available
-            }
-
-            sf->freePages = free->next;              //update the free list
-            free->next = sf->textPages[new_pid];     //insert the free cell into the new process's text segment list
-            sf->textPages[new_pid] = free;
-
-            KASSERT(!free->isStoreOp);  //cell not in storing operation at the moment
-
-            //wait for storing operations to end
-            lock_acquire(ptr->operationLock);
-            while (ptr->isStoreOp) {
-                cv_wait(ptr->operationCV, ptr->operationLock);
+    int ptr, free;               //slots for traversing and allocating swap cells
+    int n = 0, i;                //number of pages written to the disk
+    struct swapIORequest *r;     //request writing the current buffer
+    void *buf;                   //buffer holding the current page
+
+    for (ptr = sf->procPages[old_pid]; ptr != SWAP_NONE; ptr = SLOT_PAGE(ptr)->procNext) {
+
+        if (IS_ZERO_SLOT(ptr)) {
+            // Zero pages have no content: the new process just needs its own zero entry
+            free = allocZeroSlot();
+            if (free != SWAP_NONE) {
+                SLOT_PAGE(free)->vaddr = SLOT_PAGE(ptr)->vaddr;
+                SLOT_PAGE(free)->pid = new_pid;
+                swapMapInsert(free);
+                continue;
             }
-            lock_release(ptr->operationLock);
-
-            DEBUG(DB_SWAP,"Copying from 0x%x to 0x%x\n",ptr->swapOffset,free->swapOffset);
+        }
 
-            // read the page from the old process's swap entry into the kernel buffer
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, ptr->swapOffset, UIO_READ);
-            result = VOP_READ(sf->v, &u);
-            if (result) {
-                panic("VOP_READ in swapfile failed, with result=%d", result);  //read failure
+        if (IS_CACHE_SLOT(ptr)) {
+            // The page is in the swap cache: copy it without decompressing it, if the pool has room
+            free = allocCacheSlot();
+            if (free != SWAP_NONE) {
+                if (swapCacheCopy(SLOT_TO_CACHE(free), SLOT_TO_CACHE(ptr)) == 0) {
+                    SLOT_PAGE(free)->vaddr = SLOT_PAGE(ptr)->vaddr;
+                    SLOT_PAGE(free)->pid = new_pid;
+                    swapMapInsert(free);
+                    DEBUG(DB_SWAP,"Copied 0x%x for process %d in the swap cache\n",SLOT_PAGE(free)->vaddr,new_pid);
+                    continue;
+                }
+                bitmap_unmark(sf->cacheMap, SLOT_TO_CACHE(free));
             }
+        }
 
-            // Write the page from the kernel buffer into the new process's swap entry
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, free->swapOffset, UIO_WRITE);
-            result = VOP_WRITE(sf->v, &u);
+        /**
+         * The copy goes to the disk. The pages are written asynchronously through
+         * SWAP_COPY_BUFFERS buffers, so the write of a page overlaps with the read of the next ones.
+        */
+        r = &sf->copyReqs[n % SWAP_COPY_BUFFERS];
+        buf = sf->kbuf[n % SWAP_COPY_BUFFERS];
+        if (n >= SWAP_COPY_BUFFERS) {
+            result = swapIOWait(r); //the buffer is still being written
             if (result) {
-                panic("VOP_WRITE in swapfile failed, with result=%d", result);  //write failure
+                panic("Write in swapfile failed, with result=%d", result);  //write failure
             }
-
-            DEBUG(DB_SWAP,"Copied text from 0x%x to 0x%x for process %d\n",ptr->vaddr,free->vaddr,new_pid);
-            free->vaddr = ptr->vaddr; //set virtual address for the new swap entry
         }
-    }
-    
-    // Duplicating the data segment swap entries for the new process
-    if (sf->dataPages[old_pid] != NULL) {
-        for (ptr = sf->dataPages[old_pid]; ptr != NULL; ptr = ptr->next) {
-            
-            // Fetch a free swap cell from the free list
-            free = sf->freePages;
-            if (free == NULL) {
-                panic("The swapfile is full!");  //no free swap cells available
-            }
-
-            sf->freePages = free->next;              //update the free list
-            free->next = sf->dataPages[new_pid];     //insert the free cell into the new process's data segment list
-            sf->dataPages[new_pid] = free;
 
-            KASSERT(!free->isStoreOp);  //cell not in storing operation at the moment
+        // Fetch a free swap cell from the allocator
+        free = allocSwapSlot();
+        SLOT_PAGE(free)->vaddr = SLOT_PAGE(ptr)->vaddr; //set virtual address and owner of the new swap entry
+        SLOT_PAGE(free)->pid = new_pid;
 
-           //wait for storing operations to end
-            lock_acquire(ptr->operationLock);
-            while (ptr->isStoreOp) {
-                cv_wait(ptr->operationCV, ptr->operationLock);
-            }
-            lock_release(ptr->operationLock);
+        if (IS_ZERO_SLOT(ptr)) {
+            // no zero entry is left: the copy of the zero page goes to the disk
+            bzero(buf, PAGE_SIZE);
+        }
+        else if (IS_CACHE_SLOT(ptr)) {
+            // the copy of a cached page goes to the disk: decompress it into the kernel buffer
+            swapCacheLoad(SLOT_TO_CACHE(ptr), buf);
+        }
+        else {
+            //wait for storing operations to end
+            waitSlotWrite(ptr);
 
-            DEBUG(DB_SWAP,"Copying from 0x%x to 0x%x\n",ptr->swapOffset,free->swapOffset);
+            DEBUG(DB_SWAP,"Copying from slot %d to slot %d\n",ptr,free);
 
-            // Read the page from the old process's swap entry into the kernel buffer
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, ptr->swapOffset, UIO_READ);
-            result = VOP_READ(sf->v, &u);
-            if (result) {
-                panic("VOP_READ in swapfile failed, with result=%d", result);  //read failure
-            }
-
-            // Write the page from the kernel buffer into the new process's swap entry
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, free->swapOffset, UIO_WRITE);
-            result = VOP_WRITE(sf->v, &u);
+            // read the page from the old process's swap entry into the kernel buffer
+            result = swapIO(ptr, buf, UIO_READ);
             if (result) {
-                panic("VOP_WRITE in swapfile failed, with result=%d", result);  //write failure
+                panic("Read from swapfile failed, with result=%d", result);  //read failure
             }
-
-            DEBUG(DB_SWAP,"Copied data from 0x%x to 0x%x for process %d\n",ptr->vaddr,free->vaddr,new_pid);
-            free->vaddr = ptr->vaddr; //set virtual address for the new swap entry
         }
-    }
-
-    // Duplicating the stack segment swap entries for the new process
-    if (sf->stackPages[old_pid] != NULL) {
-        for (ptr = sf->stackPages[old_pid]; ptr != NULL; ptr = ptr->next) {
-            
-            // Fetch a free swap cell from the free list
-            free = sf->freePages;
-            if (free == NULL) {
-                panic("The swapfile is full!");  //no free swap cells available
-            }
 
-            sf->freePages = free->next;              //update the free list
-            free->next = sf->stackPages[new_pid];    //insert the free cell into the new process's stack segment list
-            sf->stackPages[new_pid] = free;
+        // Start writing the page from the kernel buffer into the new process's swap entry
+        swapIOSubmit(r, free, buf, UIO_WRITE, NULL, NULL);
+        n++;
 
-            KASSERT(!free->isStoreOp); //cell not in storing operation at the moment
-
-            //wait for storing operations to end
-            lock_acquire(ptr->operationLock);
-            while (ptr->isStoreOp) {
-                cv_wait(ptr->operationCV, ptr->operationLock);
-            }
-            lock_release(ptr->operationLock);
-
-            DEBUG(DB_SWAP,"Copying from 0x%x to 0x%x\n",ptr->swapOffset,free->swapOffset);
-
-            // Read the page from the old process's swap entry into the kernel buffer
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, ptr->swapOffset, UIO_READ);
-            result = VOP_READ(sf->v, &u);
-            if (result) {
-                panic("VOP_READ in swapfile failed, with result=%d", result);  //read failure
-            }
+        //the write is tracked, so the new entry can be published in the swap map right away
+        swapMapInsert(free);
 
-            // Write the page from the kernel buffer into the new process's swap entry
-            uio_kinit(&iov, &u, sf->kbuf, PAGE_SIZE, free->swapOffset, UIO_WRITE);
-            result = VOP_WRITE(sf->v, &u);
-            if (result) {
-                panic("VOP_WRITE in swapfile failed, with result=%d", result);  //write failure
-            }
+        DEBUG(DB_SWAP,"Copying 0x%x for process %d\n",SLOT_PAGE(free)->vaddr,new_pid);
+    }
 
-            DEBUG(DB_SWAP,"Copied stack from 0x%x to 0x%x for process %d\n",ptr->vaddr,free->vaddr,new_pid);
-            free->vaddr = ptr->vaddr; //set virtual address for the new swap entry
+    // Wait for the writes still in progress
+    for (i = 0; i < SWAP_COPY_BUFFERS && i < n; i++) {
+        result = swapIOWait(&sf->copyReqs[i]);
+        if (result) {
+            panic("Write in swapfile failed, with result=%d", result);  //write failure
         }
     }
-    
 }
 
 /**
- * After the entire program finishes, we reorder all the pages in the swap file.
- * Since lower offsets result in faster I/O, this function helps maintain performance.
+ * Prints, for each swap device, the number of pages transferred and the throughput.
 */
-void optimizeSwapfile(void){
-
-    struct swapPage *p=sf->freePages;
-
-    // Start from index i=0, ensuring that the first free frame has an offset of 0
-    for(int i=0; i<sf->sizeSF; i++){
-        p->swapOffset=i*PAGE_SIZE;
-        p=p->next;
+void printSwapDevices(void){
+    int i;
+    struct swapDevice *dev;
+    uint32_t reads, writes, kbps;
+    uint64_t usec;
+
+    kprintf("Swap devices:\n");
+    for(i=0;i<sf->nDevices;i++){
+        dev = &sf->devices[i];
+
+        spinlock_acquire(&dev->statsLock);
+        reads = dev->pagesRead;
+        writes = dev->pagesWritten;
+        usec = (uint64_t)dev->ioTime.tv_sec*1000000 + dev->ioTime.tv_nsec/1000;
+        spinlock_release(&dev->statsLock);
+
+        kbps = usec ? (uint32_t)((uint64_t)(reads+writes)*(PAGE_SIZE/1024)*1000000/usec) : 0;
+        kprintf("\t%s: %d pages, reads = %d, writes = %d, throughput = %d KB/s\n",
+                dev->name, dev->nSlots, reads, writes, kbps);
     }
-}
\ No newline at end of file
+    kprintf("\n");
+}
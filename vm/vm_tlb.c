@@ -7,6 +7,7 @@
 #include "current.h"
 #include "vm.h"
 #include "vmstats.h"
+#include "synch.h"
 
 
 #if OPT_FINAL
@@ -26,6 +27,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress){
     
     int spl = splhigh(); //disabling the interrupt not to block TLB update
     paddr_t paddr;
+    struct addrspace *as;
   
     faultaddress &= PAGE_FRAME; // get the address that wasn't in the TLB (removing the offset)
     incrementStatistics(FAULT);
@@ -46,12 +48,17 @@ int vm_fault(int faulttype, vaddr_t faultaddress){
     default:
         break;
     }
+    as = proc_getas();
+    KASSERT(as != NULL);
+    //The regions are only read from here on, so faults don't exclude each other (only region changes)
+    rwlock_acquire_read(as->as_lock);
     //Check if the address space is setted up correctly
     KASSERT(as_is_correct() == 1);
     //Get physical address that it's not present in the TLB from the Page Table
     paddr = getFramePT(faultaddress);
     //Insert address into the TLB
     tlbInsert(faultaddress, paddr);
+    rwlock_release_read(as->as_lock);
     splx(spl); //restoring the interrupts
     return 0;
 }
@@ -134,6 +141,7 @@ int tlbVictim(void){
 
 /*
 Defines if, given the virtual address of a frame, it is read only or not.
+The caller holds the region lock of the address space for reading.
 */
 int segmentIsReadOnly(vaddr_t virtualAddr){
     struct addrspace *as;
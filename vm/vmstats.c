@@ -1,156 +1,110 @@
 #include "vmstats.h"
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 
 // Global variables
-struct statistics_tlb statistics_tlb = {0};
-struct statistics_pt statistics_pt = {0};
+struct statistics_cpu statistics_cpus[MAXCPUS];
 
 // Init statistics
 void initializeStatistics(void) {
-    spinlock_init(&statistics_tlb.lock);
-    spinlock_init(&statistics_pt.lock);
-    
-    statistics_tlb.tlb_faults = 0;
-    statistics_tlb.tlb_faults_with_free = 0;
-    statistics_tlb.tlb_faults_with_replace = 0;
-    statistics_tlb.tlb_invalidations = 0;
-    statistics_tlb.tlb_reloads = 0;
-    
-    statistics_pt.pt_faults_zeroed = 0;
-    statistics_pt.pt_faults_disk = 0;
-    statistics_pt.pt_faults_from_elf = 0;
-    statistics_pt.pt_faults_from_swapfile = 0;
-    statistics_pt.pt_swapfile_writes = 0;
+    unsigned i, j;
+
+    for (i = 0; i < MAXCPUS; i++) {
+        for (j = 0; j < NUM_STATISTICS; j++) {
+            statistics_cpus[i].counters[j] = 0;
+        }
+    }
 }
 
+// Bump a counter of the current CPU. Interrupts are turned off so that we are
+// not moved to another CPU (or interrupted) halfway through the 64-bit update.
 void incrementStatistics(int type) {
-    spinlock_acquire(&statistics_tlb.lock);
-    spinlock_acquire(&statistics_pt.lock);
+    int spl;
 
-    switch (type) {
-        case FAULT:
-            statistics_tlb.tlb_faults++;
-            break;
-        case FAULT_WITH_FREE:
-            statistics_tlb.tlb_faults_with_free++;
-            break;
-        case FAULT_WITH_REPLACE:
-            statistics_tlb.tlb_faults_with_replace++;
-            break;
-        case INVALIDATION:
-            statistics_tlb.tlb_invalidations++;
-            break;
-        case RELOAD:
-            statistics_tlb.tlb_reloads++;
-            break;
-        case FAULT_ZEROED:
-            statistics_pt.pt_faults_zeroed++;
-            break;
-        case FAULT_DISK:
-            statistics_pt.pt_faults_disk++;
-            break;
-        case FAULT_FROM_ELF:
-            statistics_pt.pt_faults_from_elf++;
-            break;
-        case FAULT_FROM_SWAPFILE:
-            statistics_pt.pt_faults_from_swapfile++;
-            break;
-        case SWAPFILE_WRITES:
-            statistics_pt.pt_swapfile_writes++;
-            break;
-        default:
-            break;
+    if (type < 0 || type >= NUM_STATISTICS) {
+        return;
     }
 
-    spinlock_release(&statistics_pt.lock);
-    spinlock_release(&statistics_tlb.lock);
+    spl = splhigh();
+    statistics_cpus[curcpu->c_number].counters[type]++;
+    splx(spl);
 }
 
-uint32_t returnTLBStatistics(int type) {
-    uint32_t result;
+// Read a counter of another CPU. On 32-bit MIPS a 64-bit load is two 32-bit
+// loads, so it can tear if the owner increments the counter in between (e.g.
+// when the low word wraps); the counter is read again until two reads agree.
+static uint64_t readCounter(const volatile uint64_t *counter) {
+    uint64_t value, again;
+
+    value = *counter;
+    while ((again = *counter) != value) {
+        value = again;
+    }
+    return value;
+}
 
-    spinlock_acquire(&statistics_tlb.lock);
+// Sum a counter over all the CPUs. Each per-CPU value is read whole, but other
+// CPUs keep counting while we add them up, so the total is a snapshot that may be
+// slightly behind while the system is busy.
+static uint64_t sumStatistics(int type) {
+    uint64_t result = 0;
+    unsigned i;
 
+    for (i = 0; i < MAXCPUS; i++) {
+        result += readCounter(&statistics_cpus[i].counters[type]);
+    }
+    return result;
+}
+
+uint64_t returnTLBStatistics(int type) {
     switch (type) {
         case FAULT:
-            result = statistics_tlb.tlb_faults;
-            break;
         case FAULT_WITH_FREE:
-            result = statistics_tlb.tlb_faults_with_free;
-            break;
         case FAULT_WITH_REPLACE:
-            result = statistics_tlb.tlb_faults_with_replace;
-            break;
         case INVALIDATION:
-            result = statistics_tlb.tlb_invalidations;
-            break;
         case RELOAD:
-            result = statistics_tlb.tlb_reloads;
-            break;
+            return sumStatistics(type);
         default:
-            result = 0;
-            break;
+            return 0;
     }
-
-    spinlock_release(&statistics_tlb.lock);
-    return result;
 }
 
-uint32_t returnPTStatistics(int type) {
-    uint32_t result;
-
-    spinlock_acquire(&statistics_pt.lock);
-
+uint64_t returnPTStatistics(int type) {
     switch (type) {
         case FAULT_ZEROED:
-            result = statistics_pt.pt_faults_zeroed;
-            break;
         case FAULT_DISK:
-            result = statistics_pt.pt_faults_disk;
-            break;
         case FAULT_FROM_ELF:
-            result = statistics_pt.pt_faults_from_elf;
-            break;
         case FAULT_FROM_SWAPFILE:
-            result = statistics_pt.pt_faults_from_swapfile;
-            break;
+        case FAULT_SWAP_ZERO:
+        case FAULT_FROM_SWAPCACHE:
+            return sumStatistics(type);
         default:
-            result = 0;
-            break;
+            return 0;
     }
-
-    spinlock_release(&statistics_pt.lock);
-    return result;
 }
 
-uint32_t returnSWStatistics(int type) {
-    uint32_t result;
-
-    spinlock_acquire(&statistics_pt.lock);
-
+uint64_t returnSWStatistics(int type) {
     switch (type) {
         case SWAPFILE_WRITES:
-            result = statistics_pt.pt_swapfile_writes;
-            break;
+        case SWAP_ZERO_PAGES:
+            return sumStatistics(type);
         default:
-            result = 0;
-            break;
+            return 0;
     }
-
-    spinlock_release(&statistics_pt.lock);
-    return result;
 }
 
-void constraintsCheck(uint32_t tlbFaults, uint32_t tlbFree, uint32_t tlbReplace, uint32_t tlbReload, uint32_t disk, uint32_t zeroed, uint32_t elf, uint32_t swapfile) {
+void constraintsCheck(uint64_t tlbFaults, uint64_t tlbFree, uint64_t tlbReplace, uint64_t tlbReload, uint64_t disk, uint64_t zeroed, uint64_t swapcache, uint64_t elf, uint64_t swapfile) {
     if (tlbFaults == (tlbFree + tlbReplace)) {
         kprintf("CORRECT: the sum of TLB Faults with Free and TLB Faults with Replace is equal to TLB Faults\n");
     } else {
         kprintf("WARNING: the sum of TLB Faults with Free and TLB Faults with Replace is not equal to TLB Faults\n");
     }
 
-    if (tlbFaults == (tlbReload + disk + zeroed)) {
-        kprintf("CORRECT: the sum of TLB Reloads, Page Faults Disk and Page Faults Zeroed is equal to TLB Faults\n");
+    if (tlbFaults == (tlbReload + disk + zeroed + swapcache)) {
+        kprintf("CORRECT: the sum of TLB Reloads, Page Faults Disk, Page Faults Zeroed and Page Faults from Swap Cache is equal to TLB Faults\n");
     } else {
-        kprintf("WARNING: the sum of TLB reloads, Page Faults Disk and Page Faults Zeroed is not equal to TLB Faults\n");      
+        kprintf("WARNING: the sum of TLB reloads, Page Faults Disk, Page Faults Zeroed and Page Faults from Swap Cache is not equal to TLB Faults\n");      
     }
 
     if (disk == (elf + swapfile)) {
@@ -161,33 +115,39 @@ void constraintsCheck(uint32_t tlbFaults, uint32_t tlbFree, uint32_t tlbReplace,
 }
 
 void printStatistics(void) {
-    uint32_t tlb_faults = returnTLBStatistics(FAULT);
-    uint32_t tlb_faults_with_free = returnTLBStatistics(FAULT_WITH_FREE);
-    uint32_t tlb_faults_with_replace = returnTLBStatistics(FAULT_WITH_REPLACE);
-    uint32_t tlb_invalidations = returnTLBStatistics(INVALIDATION);
-    uint32_t tlb_reloads = returnTLBStatistics(RELOAD);
-    uint32_t pt_faults_zeroed = returnPTStatistics(FAULT_ZEROED);
-    uint32_t pt_faults_disk = returnPTStatistics(FAULT_DISK);
-    uint32_t pt_faults_from_elf = returnPTStatistics(FAULT_FROM_ELF);
-    uint32_t pt_faults_from_swapfile = returnPTStatistics(FAULT_FROM_SWAPFILE);
-    uint32_t pt_swapfile_writes = returnSWStatistics(SWAPFILE_WRITES);
+    uint64_t tlb_faults = returnTLBStatistics(FAULT);
+    uint64_t tlb_faults_with_free = returnTLBStatistics(FAULT_WITH_FREE);
+    uint64_t tlb_faults_with_replace = returnTLBStatistics(FAULT_WITH_REPLACE);
+    uint64_t tlb_invalidations = returnTLBStatistics(INVALIDATION);
+    uint64_t tlb_reloads = returnTLBStatistics(RELOAD);
+    uint64_t pt_faults_zeroed = returnPTStatistics(FAULT_ZEROED);
+    uint64_t pt_faults_disk = returnPTStatistics(FAULT_DISK);
+    uint64_t pt_faults_from_elf = returnPTStatistics(FAULT_FROM_ELF);
+    uint64_t pt_faults_from_swapfile = returnPTStatistics(FAULT_FROM_SWAPFILE);
+    uint64_t pt_swapfile_writes = returnSWStatistics(SWAPFILE_WRITES);
+    uint64_t pt_swap_zero_pages = returnSWStatistics(SWAP_ZERO_PAGES);
+    uint64_t pt_faults_swap_zero = returnPTStatistics(FAULT_SWAP_ZERO);
+    uint64_t pt_faults_from_swapcache = returnPTStatistics(FAULT_FROM_SWAPCACHE);
 
     kprintf("\nTLB statistics:\n"
-            "\tTLB Faults = %d\n"
-            "\tTLB Faults with Free = %d\n"
-            "\tTLB Faults with Replace = %d\n"
-            "\tTLB Invalidations = %d\n"
-            "\tTLB Reloads = %d\n",
+            "\tTLB Faults = %llu\n"
+            "\tTLB Faults with Free = %llu\n"
+            "\tTLB Faults with Replace = %llu\n"
+            "\tTLB Invalidations = %llu\n"
+            "\tTLB Reloads = %llu\n",
             tlb_faults, tlb_faults_with_free, tlb_faults_with_replace, tlb_invalidations, tlb_reloads);
 
     kprintf("PT statistics:\n"
-            "\tPage Faults (Zeroed) = %d\n"
-            "\tPage Faults (Disk) = %d\n"
-            "\tPage Faults from ELF = %d\n"
-            "\tPage Faults from Swapfile = %d\n",
-            pt_faults_zeroed, pt_faults_disk, pt_faults_from_elf, pt_faults_from_swapfile);
-
-    kprintf("\nSwapfile writes = %d\n\n", pt_swapfile_writes);
-
-    constraintsCheck(tlb_faults, tlb_faults_with_free, tlb_faults_with_replace, tlb_reloads, pt_faults_disk, pt_faults_zeroed, pt_faults_from_elf, pt_faults_from_swapfile);
+            "\tPage Faults (Zeroed) = %llu\n"
+            "\tPage Faults (Disk) = %llu\n"
+            "\tPage Faults from ELF = %llu\n"
+            "\tPage Faults from Swapfile = %llu\n"
+            "\tPage Faults (Zeroed) on swapped zero pages = %llu\n"
+            "\tPage Faults from Swap Cache (no disk I/O) = %llu\n",
+            pt_faults_zeroed, pt_faults_disk, pt_faults_from_elf, pt_faults_from_swapfile, pt_faults_swap_zero, pt_faults_from_swapcache);
+
+    kprintf("\nSwapfile writes = %llu\n", pt_swapfile_writes);
+    kprintf("Zero pages swapped out without I/O = %llu\n\n", pt_swap_zero_pages);
+
+    constraintsCheck(tlb_faults, tlb_faults_with_free, tlb_faults_with_replace, tlb_reloads, pt_faults_disk, pt_faults_zeroed, pt_faults_from_swapcache, pt_faults_from_elf, pt_faults_from_swapfile);
 }